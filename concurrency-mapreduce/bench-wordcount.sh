@@ -0,0 +1,40 @@
+#! /bin/bash
+#
+# Benchmark for the MapReduce library: generates a corpus of files of different sizes, with word frequencies
+# close to Zipf's law, and times wordcount, without and with a combiner, with 1, 2, 4, ... threads, up to twice
+# the number of CPUs; then once more with a memory limit of an eighth of the corpus, which makes it spill.
+#
+#     prompt> make && ./bench-wordcount.sh [megabytes] [files]
+
+if ! [[ -x wordcount ]]; then
+    echo "wordcount executable does not exist"
+    exit 1
+fi
+
+mb=${1:-64}
+files=${2:-32}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# File i gets a share of the corpus proportional to i, so that sizes vary.
+awk -v bytes=$((mb << 20)) -v files=$files -v dir="$dir" 'BEGIN {
+    srand(1)
+    for (f = 1; f <= files; f++) {
+        size = bytes * 2 * f / (files * (files + 1))
+        name = dir "/in" f
+        for (n = 0; n < size; ) {
+            line = ""
+            for (w = 0; w < 12; w++) line = line " w" int(exp(rand() * log(1000000)))
+            print line > name
+            n += length(line) + 1
+        }
+        close(name)
+    }
+}'
+
+cpus=$(nproc)
+for ((t = 1; t <= 2 * cpus; t *= 2)); do
+    ./wordcount -q -t $t "$dir"/in*
+    ./wordcount -q -c -t $t "$dir"/in*
+done
+./wordcount -q -m $(((mb + 7) / 8)) -t $cpus "$dir"/in*
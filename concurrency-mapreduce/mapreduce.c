@@ -0,0 +1,1128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "mapreduce.h"
+
+#define ARENA_CHUNK (1 << 20)
+#define MIN_TABLE 1024
+#define SPILL_BUFFER (1 << 20)     // writes to a spill file
+#define MERGE_BUFFER (1 << 20)     // reads from a run, at most
+#define MIN_MERGE_BUFFER (64 << 10)
+#define MIN_THREAD_BUDGET (1 << 20)
+#define SUBPARTITIONS 8            // per reducer, with the default partitioner
+#define SAMPLE_EMITS (1 << 16)     // per mapper thread, to find hot keys
+
+// One emitted pair. The key and the value point into the arena of the
+// mapper thread that emitted it. prefix holds the first 8 bytes of the key,
+// big-endian and zero-padded, so that most comparisons while sorting never
+// touch the strings.
+typedef struct {
+    uint64_t prefix;
+    char *key;
+    char *value;
+} Pair;
+
+typedef struct {
+    Pair *pairs;
+    size_t len;
+    size_t cap;
+} PairList;
+
+// Strings are copied into chunks that are only freed together, once the
+// reducers are done.
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk *head;
+    size_t bytes;
+    size_t chunk_size;         // ARENA_CHUNK, less under a small memory limit
+} Arena;
+
+// A string interned in an arena: each distinct key, or value, is stored once
+// per mapper thread, right behind this record. For keys, the partition and
+// prefix are worked out once too, and with a combiner, value is the key's
+// combined value so far.
+typedef struct {
+    char *string;
+    size_t len;
+    uint64_t prefix;
+    unsigned long partition;
+    size_t count;              // of emits, while sampling
+    char *value;
+    size_t value_cap;
+} Interned;
+
+// Open addressing with linear probing, at most half full. Slots are small
+// and keep the hash, so that a probe only reads the record it finds.
+typedef struct {
+    uint64_t hash;
+    Interned *entry;           // NULL for an empty slot
+} InternSlot;
+
+typedef struct {
+    InternSlot *slots;
+    size_t mask;
+    size_t count;
+} InternTable;
+
+// Each spill appends one sorted run per partition to the buffer's spill
+// file. A record is the key's and the value's lengths as two uint32_t, then
+// both strings with their null characters.
+typedef struct {
+    off_t offset;
+    size_t bytes;
+    size_t records;
+} RunExtent;
+
+// What one mapper thread has emitted, one list per partition, with the
+// strings it interned, and the files it spilled when that grew past its
+// share of the memory limit. Only the thread itself appends to it, so
+// MR_Emit takes no lock.
+typedef struct {
+    PairList *parts;
+    size_t pair_bytes;         // capacity of the lists
+    size_t emits;              // until the partition plan is applied
+    int planned;               // hot keys have their own partitions
+    Arena arena;
+    InternTable keys;
+    InternTable values;
+    int spill_fd;              // already unlinked; -1 until the first spill
+    off_t spill_size;
+    RunExtent *runs;           // of spill s and partition p at s * num_partitions + p
+    int num_spills;
+    int spills_cap;
+} EmitBuffer;
+
+typedef struct {
+    char *name;
+    off_t size;
+    int index;                 // position in argv, to keep the order of files of equal size
+} InputFile;
+
+// One sorted input of a merge: either the pairs a partition still has in
+// memory, or one of its runs in a spill file, read through a buffer. key and
+// value point to the current record; they stay valid until the next one is
+// read.
+typedef struct {
+    uint64_t prefix;
+    char *key;
+    char *value;
+    int done;
+    Pair *pairs;
+    size_t next;
+    size_t len;
+    int fd;
+    off_t offset;              // of what has not been read into buf yet
+    off_t end;
+    char *buf;
+    size_t buf_pos;            // of the current record
+    size_t buf_len;
+    size_t buf_cap;
+    size_t record_size;
+} MergeSource;
+
+// A k-way merge with a loser tree: tree[1..k-1] hold the source that lost at
+// each node, and winner is the source with the smallest key. Replacing the
+// winner's record takes one comparison per level.
+typedef struct {
+    MergeSource *sources;
+    int k;
+    int *tree;
+    int winner;
+    int pending;               // the winner's value was handed out; it moves on at the next call
+} Merge;
+
+// A partition once the mappers are done: size is the number of its pairs,
+// spilled or not, that reducers take the largest partitions first by. Then
+// the pairs of every mapper, sorted
+// by key. next and end delimit the values of the key being reduced. If the
+// partition has spilled runs, it is merged instead, and key holds a copy of
+// the key being reduced. Each is only used by the reducer thread that owns
+// it; the alignment keeps them on separate cache lines.
+typedef struct {
+    size_t size;
+    Pair *pairs;
+    size_t len;
+    size_t next;
+    size_t end;
+    Merge *merge;
+    char *key;
+    size_t key_cap;
+    uint64_t key_prefix;
+} __attribute__((aligned(64))) Partition;
+
+static struct {
+    Mapper map;
+    Reducer reduce;
+    Partitioner partition;
+    Combiner combine;
+    int num_reducers;
+    int num_partitions;
+    int hash_partitions;       // what the partitioner spreads keys over
+    int max_hot;               // partitions after those for hot keys
+    int planned;               // set, with release, once hot_keys is final
+    pthread_mutex_t plan_lock;
+    Interned **hot_keys;       // partition is the key's own
+    int num_hot;
+    int num_buffers;           // one per mapper thread, plus the shared one
+    EmitBuffer *buffers;
+    pthread_mutex_t shared_lock;   // for MR_Emit from threads that are not mappers
+    InputFile *files;
+    int num_files;
+    int next_file;             // taken with an atomic increment
+    Partition *partitions;
+    int *order;                // partitions, largest first
+    int next_partition;        // taken with an atomic increment
+    size_t memory_limit;       // as set, 0 for the default
+    size_t limit;              // in effect for this run
+    size_t thread_budget;      // its share for each buffer
+} mr = { .shared_lock = PTHREAD_MUTEX_INITIALIZER, .plan_lock = PTHREAD_MUTEX_INITIALIZER };
+
+// The calling mapper thread's buffer, NULL in any other thread.
+static __thread EmitBuffer *local_buffer;
+
+unsigned long MR_DefaultHashPartition(char *key, int num_partitions) {
+    unsigned long hash = 5381;
+    int c;
+    while ((c = *key++) != '\0') {
+        hash = hash * 33 + c;
+    }
+    return hash % num_partitions;
+}
+
+static void *checked_malloc(size_t size) {
+    void *ptr = malloc(size);
+    if (!ptr) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+static uint64_t key_prefix(const char *key, size_t len) {
+    uint64_t prefix = 0;
+    for (size_t i = 0; i < 8; i++) {
+        prefix = prefix << 8 | (i < len ? (unsigned char)key[i] : 0);
+    }
+    return prefix;
+}
+
+// size bytes, 8-byte aligned.
+static void *arena_alloc(Arena *arena, size_t size) {
+    ArenaChunk *chunk = arena->head;
+    size = (size + 7) & ~(size_t)7;
+    if (!chunk || chunk->size - chunk->used < size) {
+        // Large blocks get a chunk of their own, behind the current one.
+        size_t chunk_size = size > arena->chunk_size / 4 ? size : arena->chunk_size;
+        chunk = checked_malloc(sizeof(ArenaChunk) + chunk_size);
+        chunk->used = 0;
+        chunk->size = chunk_size;
+        if (chunk_size != arena->chunk_size && arena->head) {
+            chunk->next = arena->head->next;
+            arena->head->next = chunk;
+        } else {
+            chunk->next = arena->head;
+            arena->head = chunk;
+        }
+        arena->bytes += sizeof(ArenaChunk) + chunk_size;
+    }
+    void *block = chunk->data + chunk->used;
+    chunk->used += size;
+    return block;
+}
+
+static char *arena_copy(Arena *arena, const char *s, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+static void arena_free(Arena *arena) {
+    while (arena->head) {
+        ArenaChunk *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+    arena->bytes = 0;
+}
+
+static uint64_t hash_string(const char *s, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)s[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+void MR_SetMemoryLimit(size_t bytes) {
+    mr.memory_limit = bytes;
+}
+
+static void table_init(InternTable *table) {
+    table->slots = calloc(MIN_TABLE, sizeof(InternSlot));
+    if (!table->slots) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    table->mask = MIN_TABLE - 1;
+    table->count = 0;
+}
+
+static void table_grow(InternTable *table) {
+    InternSlot *old = table->slots;
+    size_t old_size = table->mask + 1;
+    table->slots = calloc(old_size * 2, sizeof(InternSlot));
+    if (!table->slots) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    table->mask = old_size * 2 - 1;
+    for (size_t i = 0; i < old_size; i++) {
+        if (old[i].entry) {
+            size_t j = old[i].hash & table->mask;
+            while (table->slots[j].entry) {
+                j = (j + 1) & table->mask;
+            }
+            table->slots[j] = old[i];
+        }
+    }
+    free(old);
+}
+
+// The entry for s, which is copied into the arena the first time it is
+// seen; *added tells whether that just happened.
+static Interned *intern(InternTable *table, Arena *arena, const char *s, size_t len, int *added) {
+    uint64_t hash = hash_string(s, len);
+    size_t i = hash & table->mask;
+    while (table->slots[i].entry) {
+        Interned *entry = table->slots[i].entry;
+        if (table->slots[i].hash == hash && entry->len == len && memcmp(entry->string, s, len) == 0) {
+            *added = 0;
+            return entry;
+        }
+        i = (i + 1) & table->mask;
+    }
+    if ((table->count + 1) * 2 > table->mask + 1) {
+        table_grow(table);
+        return intern(table, arena, s, len, added);
+    }
+    Interned *entry = arena_alloc(arena, sizeof(Interned) + len + 1);
+    memset(entry, 0, sizeof(Interned));
+    entry->string = (char *)(entry + 1);
+    entry->len = len;
+    memcpy(entry->string, s, len + 1);
+    table->slots[i].hash = hash;
+    table->slots[i].entry = entry;
+    table->count++;
+    *added = 1;
+    return entry;
+}
+
+static Interned *lookup(const InternTable *table, const char *s, size_t len) {
+    uint64_t hash = hash_string(s, len);
+    for (size_t i = hash & table->mask; table->slots[i].entry; i = (i + 1) & table->mask) {
+        Interned *entry = table->slots[i].entry;
+        if (table->slots[i].hash == hash && entry->len == len && memcmp(entry->string, s, len) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void add_pair(EmitBuffer *buffer, Interned *key, char *value) {
+    PairList *list = &buffer->parts[key->partition];
+    if (list->len == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 256;
+        list->pairs = realloc(list->pairs, cap * sizeof(Pair));
+        if (!list->pairs) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        buffer->pair_bytes += (cap - list->cap) * sizeof(Pair);
+        list->cap = cap;
+    }
+    Pair *pair = &list->pairs[list->len++];
+    pair->prefix = key->prefix;
+    pair->key = key->string;
+    pair->value = value;
+}
+
+static int compare_pairs(const void *a, const void *b) {
+    const Pair *x = a;
+    const Pair *y = b;
+    if (x->prefix != y->prefix) {
+        return x->prefix < y->prefix ? -1 : 1;
+    }
+    // Equal prefixes that end in a zero byte hold both keys in full; pairs
+    // from the same mapper thread share the interned key.
+    if ((x->prefix & 0xff) == 0 || x->key == y->key) {
+        return 0;
+    }
+    return strcmp(x->key + 8, y->key + 8);
+}
+
+static int same_key(const Pair *x, const Pair *y) {
+    return compare_pairs(x, y) == 0;
+}
+
+static size_t buffer_bytes(const EmitBuffer *buffer) {
+    return buffer->arena.bytes + buffer->pair_bytes +
+           (buffer->keys.mask + 1 + buffer->values.mask + 1) * sizeof(InternSlot);
+}
+
+static void add_combined_pairs(EmitBuffer *buffer) {
+    for (size_t i = 0; i <= buffer->keys.mask; i++) {
+        Interned *k = buffer->keys.slots[i].entry;
+        if (k) {
+            add_pair(buffer, k, k->value);
+        }
+    }
+}
+
+static void write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error writing spill file");
+            exit(1);
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+static int open_spill_file(void) {
+    const char *dir = getenv("TMPDIR");
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/mapreduce-XXXXXX", dir && *dir ? dir : "/tmp");
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        perror("Error creating spill file");
+        exit(1);
+    }
+    unlink(path);
+    return fd;
+}
+
+// Sorts each partition the buffer holds and appends it to the spill file as
+// a run, then lets go of all the buffer's memory.
+static void spill(EmitBuffer *buffer) {
+    if (mr.combine) {
+        add_combined_pairs(buffer);
+    }
+    if (buffer->num_spills == buffer->spills_cap) {
+        buffer->spills_cap = buffer->spills_cap ? buffer->spills_cap * 2 : 8;
+        buffer->runs = realloc(buffer->runs, buffer->spills_cap * mr.num_partitions * sizeof(RunExtent));
+        if (!buffer->runs) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+    }
+    if (buffer->spill_fd == -1) {
+        buffer->spill_fd = open_spill_file();
+    }
+    RunExtent *runs = &buffer->runs[buffer->num_spills++ * mr.num_partitions];
+
+    char *out = checked_malloc(SPILL_BUFFER);
+    size_t used = 0;
+    off_t offset = buffer->spill_size;
+    for (int p = 0; p < mr.num_partitions; p++) {
+        PairList *list = &buffer->parts[p];
+        if (list->len > 0) {
+            qsort(list->pairs, list->len, sizeof(Pair), compare_pairs);
+        }
+        runs[p].offset = offset;
+        for (size_t i = 0; i < list->len; i++) {
+            uint32_t lens[2] = { strlen(list->pairs[i].key), strlen(list->pairs[i].value) };
+            size_t size = sizeof(lens) + lens[0] + lens[1] + 2;
+            if (used + size > SPILL_BUFFER) {
+                write_all(buffer->spill_fd, out, used);
+                used = 0;
+            }
+            if (size > SPILL_BUFFER) {
+                write_all(buffer->spill_fd, (char *)lens, sizeof(lens));
+                write_all(buffer->spill_fd, list->pairs[i].key, lens[0] + 1);
+                write_all(buffer->spill_fd, list->pairs[i].value, lens[1] + 1);
+            } else {
+                memcpy(out + used, lens, sizeof(lens));
+                memcpy(out + used + sizeof(lens), list->pairs[i].key, lens[0] + 1);
+                memcpy(out + used + sizeof(lens) + lens[0] + 1, list->pairs[i].value, lens[1] + 1);
+                used += size;
+            }
+            offset += size;
+        }
+        runs[p].bytes = offset - runs[p].offset;
+        runs[p].records = list->len;
+        free(list->pairs);
+        memset(list, 0, sizeof(PairList));
+    }
+    write_all(buffer->spill_fd, out, used);
+    free(out);
+    buffer->spill_size = offset;
+
+    buffer->pair_bytes = 0;
+    arena_free(&buffer->arena);
+    free(buffer->keys.slots);
+    free(buffer->values.slots);
+    table_init(&buffer->keys);
+    table_init(&buffer->values);
+}
+
+// The partition of a hot key, or -1. The list is short and most keys differ
+// from every hot key in their prefix or length.
+static int hot_partition(const Interned *k) {
+    for (int i = 0; i < mr.num_hot; i++) {
+        Interned *hot = mr.hot_keys[i];
+        if (hot->prefix == k->prefix && hot->len == k->len && memcmp(hot->string, k->string, k->len) == 0) {
+            return hot->partition;
+        }
+    }
+    return -1;
+}
+
+// Picks the hot keys from what the buffer has sampled, unless another thread
+// already has: the keys that make up more of the sample than an average
+// partition, up to max_hot of them, most frequent first. Every buffer has to
+// send a key to the same partition, so the plan is made once.
+static void plan_partitions(EmitBuffer *buffer) {
+    pthread_mutex_lock(&mr.plan_lock);
+    if (!mr.planned) {
+        Interned *hot[mr.max_hot];
+        int num_hot = 0;
+        for (size_t i = 0; i <= buffer->keys.mask && buffer->keys.slots; i++) {
+            Interned *k = buffer->keys.slots[i].entry;
+            if (!k || k->count * mr.hash_partitions <= buffer->emits) {
+                continue;
+            }
+            int j = num_hot < mr.max_hot ? num_hot++ : mr.max_hot;
+            while (j > 0 && hot[j - 1]->count < k->count) {
+                if (j < mr.max_hot) {
+                    hot[j] = hot[j - 1];
+                }
+                j--;
+            }
+            if (j < mr.max_hot) {
+                hot[j] = k;
+            }
+        }
+
+        mr.hot_keys = checked_malloc((num_hot ? num_hot : 1) * sizeof(Interned *));
+        for (int i = 0; i < num_hot; i++) {
+            Interned *copy = checked_malloc(sizeof(Interned) + hot[i]->len + 1);
+            memset(copy, 0, sizeof(Interned));
+            copy->string = (char *)(copy + 1);
+            copy->len = hot[i]->len;
+            copy->prefix = hot[i]->prefix;
+            copy->partition = mr.hash_partitions + i;
+            memcpy(copy->string, hot[i]->string, copy->len + 1);
+            mr.hot_keys[i] = copy;
+        }
+        mr.num_hot = num_hot;
+        __atomic_store_n(&mr.planned, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&mr.plan_lock);
+}
+
+// Moves the hot keys the buffer has seen to their own partitions, with the
+// pairs already added for them.
+static void apply_plan(EmitBuffer *buffer) {
+    for (int i = 0; i < mr.num_hot; i++) {
+        Interned *hot = mr.hot_keys[i];
+        Interned *k = lookup(&buffer->keys, hot->string, hot->len);
+        if (!k) {
+            continue;
+        }
+        PairList *from = &buffer->parts[k->partition];
+        k->partition = hot->partition;
+        size_t kept = 0;
+        for (size_t j = 0; j < from->len; j++) {
+            if (from->pairs[j].key == k->string) {
+                add_pair(buffer, k, from->pairs[j].value);
+            } else {
+                from->pairs[kept++] = from->pairs[j];
+            }
+        }
+        from->len = kept;
+    }
+    buffer->planned = 1;
+}
+
+// Keys are interned, so the partitioner runs once per distinct key. Without
+// a combiner each value is interned as well and a pair is added; with one,
+// the value is combined into the key's, and the pairs are only added once
+// the thread has mapped all its files.
+static void emit_into(EmitBuffer *buffer, char *key, char *value) {
+    size_t key_len = strlen(key);
+    size_t value_len = strlen(value);
+    int added;
+    Interned *k = intern(&buffer->keys, &buffer->arena, key, key_len, &added);
+    if (added) {
+        k->prefix = key_prefix(key, key_len);
+        int hot = buffer->planned ? hot_partition(k) : -1;
+        if (hot >= 0) {
+            k->partition = hot;
+        } else {
+            unsigned long p = mr.partition(key, mr.hash_partitions);
+            k->partition = p < (unsigned long)mr.hash_partitions ? p : p % mr.hash_partitions;
+        }
+    }
+    k->count++;
+
+    if (!mr.combine) {
+        Interned *v = intern(&buffer->values, &buffer->arena, value, value_len, &added);
+        add_pair(buffer, k, v->string);
+    } else if (!k->value) {
+        k->value = arena_copy(&buffer->arena, value, value_len);
+        k->value_cap = value_len;
+    } else {
+        char *combined = mr.combine(k->string, k->value, value);
+        size_t len = strlen(combined);
+        if (len <= k->value_cap) {
+            memmove(k->value, combined, len + 1);
+        } else {
+            k->value = arena_copy(&buffer->arena, combined, len);
+            k->value_cap = len;
+        }
+    }
+
+    // Until the plan is in place, the buffer's emits are a sample for it; it
+    // has to be before anything is spilled, too.
+    if (!buffer->planned) {
+        if (++buffer->emits >= SAMPLE_EMITS || buffer_bytes(buffer) > mr.thread_budget) {
+            plan_partitions(buffer);
+        }
+        if (__atomic_load_n(&mr.planned, __ATOMIC_ACQUIRE)) {
+            apply_plan(buffer);
+        }
+    }
+
+    if (buffer_bytes(buffer) > mr.thread_budget) {
+        spill(buffer);
+    }
+}
+
+// Turns the buffer's combined values into pairs and drops its tables; the
+// strings stay in the arena.
+static void finish_buffer(EmitBuffer *buffer) {
+    if (mr.combine) {
+        add_combined_pairs(buffer);
+    }
+    free(buffer->keys.slots);
+    free(buffer->values.slots);
+    memset(&buffer->keys, 0, sizeof(InternTable));
+    memset(&buffer->values, 0, sizeof(InternTable));
+}
+
+void MR_Emit(char *key, char *value) {
+    if (local_buffer) {
+        emit_into(local_buffer, key, value);
+        return;
+    }
+    // A thread of the application's own: fall back to the locked buffer.
+    pthread_mutex_lock(&mr.shared_lock);
+    emit_into(&mr.buffers[mr.num_buffers - 1], key, value);
+    pthread_mutex_unlock(&mr.shared_lock);
+}
+
+static int compare_files(const void *a, const void *b) {
+    const InputFile *x = a;
+    const InputFile *y = b;
+    if (x->size != y->size) {
+        return x->size < y->size ? -1 : 1;
+    }
+    return x->index - y->index;
+}
+
+// Mapper threads take files, shortest first, until there are none left. A
+// buffer still without a plan keeps its tables for the main thread to apply
+// one.
+static void *map_thread(void *arg) {
+    local_buffer = arg;
+    while (1) {
+        int i = __atomic_fetch_add(&mr.next_file, 1, __ATOMIC_RELAXED);
+        if (i >= mr.num_files) {
+            break;
+        }
+        mr.map(mr.files[i].name);
+    }
+    if (local_buffer->planned) {
+        finish_buffer(local_buffer);
+    }
+    local_buffer = NULL;
+    return NULL;
+}
+
+// Makes sure the record at buf_pos is all in the buffer, reading on through
+// the run as needed, with the buffer grown if the record is larger than it.
+// Returns 0 at the end of the run.
+static int fill_record(MergeSource *s) {
+    while (1) {
+        size_t avail = s->buf_len - s->buf_pos;
+        size_t need = sizeof(uint32_t) * 2;
+        if (avail >= need) {
+            uint32_t lens[2];
+            memcpy(lens, s->buf + s->buf_pos, sizeof(lens));
+            need += lens[0] + lens[1] + 2;
+            if (avail >= need) {
+                s->key = s->buf + s->buf_pos + sizeof(lens);
+                s->value = s->key + lens[0] + 1;
+                s->prefix = key_prefix(s->key, lens[0]);
+                s->record_size = need;
+                return 1;
+            }
+        }
+        if (s->offset == s->end) {
+            return 0;
+        }
+
+        memmove(s->buf, s->buf + s->buf_pos, avail);
+        s->buf_pos = 0;
+        s->buf_len = avail;
+        if (need > s->buf_cap) {
+            s->buf_cap = need;
+            s->buf = realloc(s->buf, s->buf_cap);
+            if (!s->buf) {
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(1);
+            }
+        }
+        size_t want = s->buf_cap - s->buf_len;
+        if ((off_t)want > s->end - s->offset) {
+            want = s->end - s->offset;
+        }
+        ssize_t n = pread(s->fd, s->buf + s->buf_len, want, s->offset);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            perror("Error reading spill file");
+            exit(1);
+        }
+        s->offset += n;
+        s->buf_len += n;
+    }
+}
+
+static void source_next(MergeSource *s) {
+    if (s->pairs) {
+        if (s->next == s->len) {
+            s->done = 1;
+        } else {
+            Pair *pair = &s->pairs[s->next++];
+            s->prefix = pair->prefix;
+            s->key = pair->key;
+            s->value = pair->value;
+        }
+        return;
+    }
+    s->buf_pos += s->record_size;
+    s->record_size = 0;
+    if (!fill_record(s)) {
+        s->done = 1;
+    }
+}
+
+static int source_less(const MergeSource *a, const MergeSource *b) {
+    if (a->done || b->done) {
+        return !a->done && b->done;
+    }
+    if (a->prefix != b->prefix) {
+        return a->prefix < b->prefix;
+    }
+    if ((a->prefix & 0xff) == 0) {
+        return 0;
+    }
+    return strcmp(a->key + 8, b->key + 8) < 0;
+}
+
+// Plays the matches below node and returns the winner; leaves are at
+// k..2k-1.
+static int init_tree(Merge *m, int node) {
+    if (node >= m->k) {
+        return node - m->k;
+    }
+    int a = init_tree(m, 2 * node);
+    int b = init_tree(m, 2 * node + 1);
+    if (source_less(&m->sources[b], &m->sources[a])) {
+        m->tree[node] = a;
+        return b;
+    }
+    m->tree[node] = b;
+    return a;
+}
+
+// Moves the winner on to its next record and replays its path to the root.
+static void advance_winner(Merge *m) {
+    int s = m->winner;
+    source_next(&m->sources[s]);
+    for (int node = (s + m->k) / 2; node >= 1; node /= 2) {
+        if (source_less(&m->sources[m->tree[node]], &m->sources[s])) {
+            int loser = s;
+            s = m->tree[node];
+            m->tree[node] = loser;
+        }
+    }
+    m->winner = s;
+}
+
+static int is_current_key(const Partition *part, const MergeSource *s) {
+    return !s->done && s->prefix == part->key_prefix &&
+           ((s->prefix & 0xff) == 0 || strcmp(s->key + 8, part->key + 8) == 0);
+}
+
+// Hands out the values of the key being reduced in partition_number, in
+// place: nothing is copied. key is that key; it is not compared again. When
+// merging, a value stays valid until the next call, which is when the merge
+// moves past it.
+static char *get_next(char *key, int partition_number) {
+    Partition *part = &mr.partitions[partition_number];
+    Merge *m = part->merge;
+    if (m) {
+        if (m->pending) {
+            advance_winner(m);
+            m->pending = 0;
+        }
+        if (!is_current_key(part, &m->sources[m->winner])) {
+            return NULL;
+        }
+        m->pending = 1;
+        return m->sources[m->winner].value;
+    }
+    if (part->next < part->end) {
+        return part->pairs[part->next++].value;
+    }
+    return NULL;
+}
+
+// Reduces partition p by merging its sorted pairs in memory with its runs in
+// the spill files. The runs are read sequentially, with a buffer each of up
+// to MERGE_BUFFER bytes, fewer if the reducers' buffers would not fit in the
+// memory limit otherwise.
+static void merge_partition(int p) {
+    Partition *part = &mr.partitions[p];
+    int max_sources = 1;
+    for (int b = 0; b < mr.num_buffers; b++) {
+        max_sources += mr.buffers[b].num_spills;
+    }
+
+    Merge merge = { .sources = calloc(max_sources, sizeof(MergeSource)) };
+    if (!merge.sources) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    if (part->len > 0) {
+        merge.sources[merge.k++].pairs = part->pairs;
+        merge.sources[0].len = part->len;
+    }
+    size_t buf_size = mr.limit / ((size_t)mr.num_reducers * max_sources);
+    buf_size = buf_size > MERGE_BUFFER ? MERGE_BUFFER : buf_size < MIN_MERGE_BUFFER ? MIN_MERGE_BUFFER : buf_size;
+    for (int b = 0; b < mr.num_buffers; b++) {
+        EmitBuffer *buffer = &mr.buffers[b];
+        for (int f = 0; f < buffer->num_spills; f++) {
+            RunExtent *run = &buffer->runs[f * mr.num_partitions + p];
+            if (run->bytes > 0) {
+                MergeSource *s = &merge.sources[merge.k++];
+                s->fd = buffer->spill_fd;
+                s->offset = run->offset;
+                s->end = run->offset + run->bytes;
+                s->buf_cap = buf_size;
+                s->buf = checked_malloc(buf_size);
+            }
+        }
+    }
+    if (merge.k == 0) {
+        free(merge.sources);
+        return;
+    }
+
+    for (int i = 0; i < merge.k; i++) {
+        source_next(&merge.sources[i]);
+    }
+    merge.tree = checked_malloc((merge.k + 1) * sizeof(int));
+    merge.winner = init_tree(&merge, 1);
+    part->merge = &merge;
+
+    while (!merge.sources[merge.winner].done) {
+        MergeSource *w = &merge.sources[merge.winner];
+        size_t len = strlen(w->key);
+        if (len + 1 > part->key_cap) {
+            part->key_cap = (len + 1) * 2;
+            free(part->key);
+            part->key = checked_malloc(part->key_cap);
+        }
+        memcpy(part->key, w->key, len + 1);
+        part->key_prefix = w->prefix;
+        merge.pending = 0;
+        mr.reduce(part->key, get_next, p);
+
+        // Skip whatever the reducer left of this key.
+        if (merge.pending) {
+            advance_winner(&merge);
+        }
+        while (is_current_key(part, &merge.sources[merge.winner])) {
+            advance_winner(&merge);
+        }
+    }
+
+    part->merge = NULL;
+    for (int i = 0; i < merge.k; i++) {
+        free(merge.sources[i].buf);
+    }
+    free(merge.sources);
+    free(merge.tree);
+    free(part->key);
+    part->key = NULL;
+    part->key_cap = 0;
+}
+
+// Gathers partition p from every buffer, sorts it and calls the reducer once
+// per key, in ascending order, merging in the partition's spilled runs if
+// there are any. The strings stay in the mapper threads' arenas until every
+// partition is done.
+static void reduce_partition(int p) {
+    Partition *part = &mr.partitions[p];
+    int spilled = 0;
+    size_t total = 0;
+    for (int b = 0; b < mr.num_buffers; b++) {
+        total += mr.buffers[b].parts[p].len;
+        spilled |= mr.buffers[b].num_spills > 0;
+    }
+
+    part->pairs = checked_malloc((total ? total : 1) * sizeof(Pair));
+    part->len = 0;
+    for (int b = 0; b < mr.num_buffers; b++) {
+        PairList *list = &mr.buffers[b].parts[p];
+        if (list->len > 0) {
+            memcpy(part->pairs + part->len, list->pairs, list->len * sizeof(Pair));
+            part->len += list->len;
+        }
+        free(list->pairs);
+        memset(list, 0, sizeof(PairList));
+    }
+    qsort(part->pairs, part->len, sizeof(Pair), compare_pairs);
+
+    if (spilled) {
+        merge_partition(p);
+    } else {
+        for (size_t i = 0; i < part->len; ) {
+            size_t end = i + 1;
+            while (end < part->len && same_key(&part->pairs[i], &part->pairs[end])) {
+                end++;
+            }
+            part->next = i;
+            part->end = end;
+            mr.reduce(part->pairs[i].key, get_next, p);
+            i = end;
+        }
+    }
+
+    free(part->pairs);
+    part->pairs = NULL;
+    part->len = 0;
+}
+
+static int compare_partitions(const void *a, const void *b) {
+    size_t x = mr.partitions[*(const int *)a].size;
+    size_t y = mr.partitions[*(const int *)b].size;
+    if (x != y) {
+        return x > y ? -1 : 1;
+    }
+    return *(const int *)a - *(const int *)b;
+}
+
+// Reducer threads take partitions, largest first, until there are none left
+// but empty ones: with several partitions per thread, the small ones even
+// out the time the threads take, and one that is mostly a hot key starts
+// early instead of last.
+static void *reduce_thread(void *arg) {
+    (void)arg;
+    while (1) {
+        int i = __atomic_fetch_add(&mr.next_partition, 1, __ATOMIC_RELAXED);
+        if (i >= mr.num_partitions || mr.partitions[mr.order[i]].size == 0) {
+            break;
+        }
+        reduce_partition(mr.order[i]);
+    }
+    return NULL;
+}
+
+void MR_Run(int argc, char *argv[],
+            Mapper map, int num_mappers,
+            Reducer reduce, int num_reducers,
+            Partitioner partition) {
+    MR_RunWithCombiner(argc, argv, map, num_mappers, reduce, num_reducers, partition, NULL);
+}
+
+void MR_RunWithCombiner(int argc, char *argv[],
+                        Mapper map, int num_mappers,
+                        Reducer reduce, int num_reducers,
+                        Partitioner partition, Combiner combine) {
+    if (num_mappers < 1) {
+        num_mappers = 1;
+    }
+    if (num_reducers < 1) {
+        num_reducers = 1;
+    }
+    mr.map = map;
+    mr.reduce = reduce;
+    mr.partition = partition ? partition : MR_DefaultHashPartition;
+    mr.combine = combine;
+    mr.num_reducers = num_reducers;
+
+    // The default partitioner makes no promise about which keys end up
+    // together, so keys are spread over more partitions than there are
+    // reducers, and hot keys get partitions of their own. Another keeps
+    // exactly the partitions it asks for.
+    if (mr.partition == MR_DefaultHashPartition) {
+        mr.hash_partitions = num_reducers * SUBPARTITIONS;
+        mr.max_hot = num_reducers;
+    } else {
+        mr.hash_partitions = num_reducers;
+        mr.max_hot = 0;
+    }
+    mr.num_partitions = mr.hash_partitions + mr.max_hot;
+    mr.planned = mr.max_hot == 0;
+    mr.hot_keys = NULL;
+    mr.num_hot = 0;
+    mr.limit = mr.memory_limit;
+    if (mr.limit == 0) {
+        mr.limit = (size_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 2;
+    }
+
+    // Shortest file first: with more files than mappers, the short ones get
+    // out of the way while the long ones are spread over the threads.
+    mr.num_files = argc > 1 ? argc - 1 : 0;
+    mr.files = checked_malloc((mr.num_files + 1) * sizeof(InputFile));
+    for (int i = 0; i < mr.num_files; i++) {
+        struct stat sb;
+        mr.files[i].name = argv[i + 1];
+        mr.files[i].size = stat(argv[i + 1], &sb) == 0 ? sb.st_size : 0;
+        mr.files[i].index = i;
+    }
+    qsort(mr.files, mr.num_files, sizeof(InputFile), compare_files);
+    mr.next_file = 0;
+
+    int num_threads = num_mappers < mr.num_files ? num_mappers : mr.num_files;
+    mr.num_buffers = num_threads + 1;
+    mr.thread_budget = mr.limit / mr.num_buffers;
+    if (mr.thread_budget < MIN_THREAD_BUDGET) {
+        mr.thread_budget = MIN_THREAD_BUDGET;
+    }
+    mr.buffers = calloc(mr.num_buffers, sizeof(EmitBuffer));
+    if (!mr.buffers) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    for (int b = 0; b < mr.num_buffers; b++) {
+        EmitBuffer *buffer = &mr.buffers[b];
+        buffer->parts = calloc(mr.num_partitions, sizeof(PairList));
+        if (!buffer->parts) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        buffer->arena.chunk_size = mr.thread_budget / 8 < ARENA_CHUNK ? mr.thread_budget / 8 : ARENA_CHUNK;
+        buffer->spill_fd = -1;
+        buffer->planned = mr.planned;
+        table_init(&buffer->keys);
+        table_init(&buffer->values);
+    }
+
+    pthread_t threads[num_threads > num_reducers ? num_threads : num_reducers];
+    for (int t = 0; t < num_threads; t++) {
+        if (pthread_create(&threads[t], NULL, map_thread, &mr.buffers[t]) != 0) {
+            perror("Error creating thread");
+            exit(1);
+        }
+    }
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    // With too little input for any buffer to fill its sample, the plan is
+    // made from the one with the most emits.
+    if (!mr.planned) {
+        EmitBuffer *busiest = &mr.buffers[0];
+        for (int b = 1; b < mr.num_buffers; b++) {
+            if (mr.buffers[b].emits > busiest->emits) {
+                busiest = &mr.buffers[b];
+            }
+        }
+        plan_partitions(busiest);
+    }
+    for (int b = 0; b < mr.num_buffers; b++) {
+        EmitBuffer *buffer = &mr.buffers[b];
+        if (!buffer->planned) {
+            apply_plan(buffer);
+        }
+        if (buffer->keys.slots) {
+            finish_buffer(buffer);
+        }
+    }
+
+    mr.partitions = aligned_alloc(sizeof(Partition), mr.num_partitions * sizeof(Partition));
+    mr.order = malloc(mr.num_partitions * sizeof(int));
+    if (!mr.partitions || !mr.order) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    memset(mr.partitions, 0, mr.num_partitions * sizeof(Partition));
+    for (int p = 0; p < mr.num_partitions; p++) {
+        for (int b = 0; b < mr.num_buffers; b++) {
+            EmitBuffer *buffer = &mr.buffers[b];
+            mr.partitions[p].size += buffer->parts[p].len;
+            for (int f = 0; f < buffer->num_spills; f++) {
+                mr.partitions[p].size += buffer->runs[f * mr.num_partitions + p].records;
+            }
+        }
+        mr.order[p] = p;
+    }
+    qsort(mr.order, mr.num_partitions, sizeof(int), compare_partitions);
+    mr.next_partition = 0;
+    for (int r = 0; r < num_reducers; r++) {
+        if (pthread_create(&threads[r], NULL, reduce_thread, NULL) != 0) {
+            perror("Error creating thread");
+            exit(1);
+        }
+    }
+    for (int r = 0; r < num_reducers; r++) {
+        pthread_join(threads[r], NULL);
+    }
+
+    for (int b = 0; b < mr.num_buffers; b++) {
+        EmitBuffer *buffer = &mr.buffers[b];
+        if (buffer->spill_fd != -1) {
+            close(buffer->spill_fd);
+        }
+        free(buffer->runs);
+        free(buffer->parts);
+        arena_free(&buffer->arena);
+    }
+    for (int i = 0; i < mr.num_hot; i++) {
+        free(mr.hot_keys[i]);
+    }
+    free(mr.hot_keys);
+    free(mr.buffers);
+    free(mr.partitions);
+    free(mr.order);
+    free(mr.files);
+    mr.hot_keys = NULL;
+    mr.buffers = NULL;
+    mr.partitions = NULL;
+    mr.order = NULL;
+    mr.files = NULL;
+}
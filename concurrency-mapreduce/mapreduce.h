@@ -1,20 +1,51 @@
 #ifndef __mapreduce_h__
 #define __mapreduce_h__
 
+#include <stddef.h>
+
 // Different function pointer types used by MR
 typedef char *(*Getter)(char *key, int partition_number);
 typedef void (*Mapper)(char *file_name);
 typedef void (*Reducer)(char *key, Getter get_func, int partition_number);
 typedef unsigned long (*Partitioner)(char *key, int num_partitions);
+// Combines two values of the same key into one, e.g. adds two counts. The
+// result may be one of the arguments, or a buffer of the combiner's own that
+// stays valid until its next call in the same thread; the library copies it.
+typedef char *(*Combiner)(char *key, char *value, char *other);
 
 // External functions: these are what you must define
 void MR_Emit(char *key, char *value);
 
 unsigned long MR_DefaultHashPartition(char *key, int num_partitions);
 
+// With MR_DefaultHashPartition, keys are spread over several partitions per
+// reducer, and the most frequent keys in a sample of the first emits get
+// partitions of their own; reducer threads take partitions largest first.
+// partition_number is then the partition of the key, which may be up to
+// num_reducers * 9, and is only meant to be passed on to get_func. Another
+// partitioner gets num_reducers partitions, as before. Either way, every key
+// is reduced once, with all its values, in ascending order within its
+// partition.
+
 void MR_Run(int argc, char *argv[], 
 	    Mapper map, int num_mappers, 
 	    Reducer reduce, int num_reducers, 
 	    Partitioner partition);
 
+// MR_Run with a combiner: each mapper thread keeps one value per key,
+// combining every value emitted for it into that one, so reducers get at
+// most one value per key from each mapper thread, or, if it spilled (see
+// MR_SetMemoryLimit), one per key per spill and one for what it held at the
+// end.
+void MR_RunWithCombiner(int argc, char *argv[],
+			Mapper map, int num_mappers,
+			Reducer reduce, int num_reducers,
+			Partitioner partition, Combiner combine);
+
+// Limits the memory that emitted pairs are held in, in bytes, shared by the
+// mapper threads. Past it, a thread sorts what it holds and spills it to a
+// temporary file in $TMPDIR, and the reducers merge the files back. 0, the
+// default, stands for half of the physical memory.
+void MR_SetMemoryLimit(size_t bytes);
+
 #endif // __mapreduce_h__
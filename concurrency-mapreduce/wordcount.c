@@ -0,0 +1,103 @@
+// Counts the words in the given files with the MapReduce library, both as an
+// example of its use and to time it:
+//
+//     prompt> ./wordcount [-t threads] [-c] [-m megabytes] [-q] file ...
+//
+// -t sets the number of mapper and of reducer threads (the number of CPUs by
+// default). -c adds up counts in the mapper threads with a combiner. -m
+// limits the memory for emitted pairs, past which they are spilled. -q
+// prints only the totals, the time and the peak memory instead of every
+// word's count.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "mapreduce.h"
+
+static int quiet;
+static long total_words;
+static long distinct_words;
+
+void Map(char *file_name) {
+    FILE *fp = fopen(file_name, "r");
+    if (!fp) {
+        perror(file_name);
+        return;
+    }
+
+    char *line = NULL;
+    size_t size = 0;
+    while (getline(&line, &size, fp) != -1) {
+        char *token, *dummy = line;
+        while ((token = strsep(&dummy, " \t\n\r")) != NULL) {
+            if (*token != '\0') {
+                MR_Emit(token, "1");
+            }
+        }
+    }
+    free(line);
+    fclose(fp);
+}
+
+char *Combine(char *key, char *value, char *other) {
+    static __thread char sum[24];
+    snprintf(sum, sizeof(sum), "%ld", atol(value) + atol(other));
+    return sum;
+}
+
+void Reduce(char *key, Getter get_next, int partition_number) {
+    long count = 0;
+    char *value;
+    while ((value = get_next(key, partition_number)) != NULL) {
+        count += atol(value);
+    }
+    if (quiet) {
+        __atomic_fetch_add(&total_words, count, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&distinct_words, 1, __ATOMIC_RELAXED);
+    } else {
+        printf("%s %ld\n", key, count);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int combine = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:cm:q")) != -1) {
+        if (opt == 't') {
+            threads = atoi(optarg);
+        } else if (opt == 'c') {
+            combine = 1;
+        } else if (opt == 'm') {
+            MR_SetMemoryLimit((size_t)atol(optarg) << 20);
+        } else if (opt == 'q') {
+            quiet = 1;
+        } else {
+            fprintf(stderr, "usage: wordcount [-t threads] [-c] [-m megabytes] [-q] file ...\n");
+            exit(1);
+        }
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    // MR_Run takes the files from argv[1] on.
+    argv[optind - 1] = argv[0];
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    MR_RunWithCombiner(argc - optind + 1, argv + optind - 1, Map, threads, Reduce, threads,
+                       MR_DefaultHashPartition, combine ? Combine : NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (quiet) {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        printf("%ld words, %ld distinct, %d threads%s, %.3f s, max-rss %ld kB\n", total_words, distinct_words,
+               threads, combine ? ", combiner" : "",
+               end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9, usage.ru_maxrss);
+    }
+    return 0;
+}
@@ -7,9 +7,11 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
 
 #define MAX_THREADS 64
 #define CHUNK_SIZE 1048576 // 1 MB
+#define STREAM_BUFFERS_PER_THREAD 2 // chunk buffers in flight per worker when streaming
 
 typedef struct {
     char *file_data;           // Pointer to the memory-mapped file data, allowing threads to access the file content directly in memory.
@@ -24,22 +26,56 @@ typedef struct {
     int thread_id;             // An identifier for the thread, useful for distinguishing between threads. This can be used for debugging or logging.
 } ThreadArg;
 
+typedef enum {
+    BUFFER_FREE,               // Available to the reader.
+    BUFFER_FILLED,             // Holds input waiting for (or being processed by) a worker.
+    BUFFER_COMPRESSED          // Holds output waiting for the writer.
+} BufferState;
+
+typedef struct {
+    char *input;               // Up to CHUNK_SIZE bytes read from the input.
+    size_t input_size;
+    char *output;              // Compressed form of input, up to 2 * CHUNK_SIZE bytes and a NUL.
+    size_t output_size;
+    BufferState state;
+} ChunkBuffer;
+
+typedef struct {
+    int fd;                    // Input being streamed; any kind of file descriptor works.
+    ChunkBuffer *buffers;      // Fixed pool; chunk number n always uses buffers[n % num_buffers].
+    int num_buffers;
+    long chunks_read;          // Chunks handed to the workers so far.
+    long chunks_claimed;       // Chunks taken by a worker so far.
+    int eof;                   // Set by the reader once chunks_read is final.
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;    // Broadcast on every state change of any buffer.
+} StreamQueue;
+
 void *compress_chunk(void *arg);
 void write_compressed_data(FILE *out, const char *data, size_t length);
+size_t compress_buffer(const char *chunk, size_t chunk_size, char *output);
+void compress_stream(int fd, FILE *out, int num_threads);
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <file1> [file2 ...]\n", argv[0]);
-        exit(1);
-    }
-
     int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
     if (num_threads > MAX_THREADS) num_threads = MAX_THREADS;
+    if (num_threads < 1) num_threads = 1;
 
     pthread_t threads[num_threads];
     ThreadArg thread_args[num_threads];
 
+    // Without file arguments, compress standard input (e.g. at the end of a pipeline).
+    if (argc < 2) {
+        compress_stream(STDIN_FILENO, stdout, num_threads);
+        return 0;
+    }
+
     for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-") == 0) {
+            compress_stream(STDIN_FILENO, stdout, num_threads);
+            continue;
+        }
+
         int fd = open(argv[i], O_RDONLY);
         if (fd == -1) {
             perror("Error opening file");
@@ -53,14 +89,15 @@ int main(int argc, char *argv[]) {
             continue;
         }
 
-        if (sb.st_size == 0) {
-            fprintf(stderr, "Error: File %s is empty.\n", argv[i]);
+        // Pipes, FIFOs and devices cannot be mapped; stream them instead.
+        if (!S_ISREG(sb.st_mode)) {
+            compress_stream(fd, stdout, num_threads);
             close(fd);
             continue;
         }
 
-        if (!S_ISREG(sb.st_mode)) {
-            fprintf(stderr, "Error: %s is not a regular file.\n", argv[i]);
+        if (sb.st_size == 0) {
+            fprintf(stderr, "Error: File %s is empty.\n", argv[i]);
             close(fd);
             continue;
         }
@@ -105,7 +142,7 @@ void *compress_chunk(void *arg) {
     ThreadArg *thread_arg = (ThreadArg *)arg;
     SharedWorkQueue *queue = thread_arg->queue;
     char *chunk = malloc(CHUNK_SIZE);
-    char *output = malloc(CHUNK_SIZE * 2); 
+    char *output = malloc(CHUNK_SIZE * 2 + 1); 
 
     while (1) {
         size_t chunk_size;
@@ -129,20 +166,7 @@ void *compress_chunk(void *arg) {
 
         pthread_mutex_unlock(&queue->mutex);
 
-        size_t output_size = 0;
-        char current_char = chunk[0];
-        int count = 1;
-
-        for (size_t i = 1; i < chunk_size; i++) {
-            if (chunk[i] == current_char) {
-                count++;
-            } else {
-                output_size += sprintf(output + output_size, "%c%d", current_char, count);
-                current_char = chunk[i];
-                count = 1;
-            }
-        }
-        output_size += sprintf(output + output_size, "%c%d", current_char, count);
+        size_t output_size = compress_buffer(chunk, chunk_size, output);
 
         pthread_mutex_lock(&queue->mutex);
         write_compressed_data(queue->out_file, output, output_size);
@@ -157,3 +181,185 @@ void *compress_chunk(void *arg) {
 void write_compressed_data(FILE *out, const char *data, size_t length) {
     fwrite(data, 1, length, out);
 }
+
+// Run-length encode chunk_size (> 0) bytes into output, which must hold
+// 2 * chunk_size + 1 bytes: two per byte when there are no runs, and the NUL
+// that sprintf adds. Returns the number of bytes written, without the NUL.
+size_t compress_buffer(const char *chunk, size_t chunk_size, char *output) {
+    size_t output_size = 0;
+    char current_char = chunk[0];
+    int count = 1;
+
+    for (size_t i = 1; i < chunk_size; i++) {
+        if (chunk[i] == current_char) {
+            count++;
+        } else {
+            output_size += sprintf(output + output_size, "%c%d", current_char, count);
+            current_char = chunk[i];
+            count = 1;
+        }
+    }
+    output_size += sprintf(output + output_size, "%c%d", current_char, count);
+    return output_size;
+}
+
+// Read up to CHUNK_SIZE bytes, retrying short reads so that chunk boundaries
+// do not depend on how the data arrives. Returns 0 at end of input; a read
+// error ends the program rather than pass for the end.
+static size_t read_chunk(int fd, char *buffer) {
+    size_t filled = 0;
+
+    while (filled < CHUNK_SIZE) {
+        ssize_t n = read(fd, buffer + filled, CHUNK_SIZE - filled);
+        if (n == 0) {
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error reading input");
+            exit(1);
+        }
+        filled += n;
+    }
+    return filled;
+}
+
+// Reader thread: fills free buffers in chunk order and blocks once every
+// buffer is in use, so memory stays bounded however large the input is.
+static void *stream_reader(void *arg) {
+    StreamQueue *sq = (StreamQueue *)arg;
+
+    while (1) {
+        ChunkBuffer *buf = &sq->buffers[sq->chunks_read % sq->num_buffers];
+
+        pthread_mutex_lock(&sq->mutex);
+        while (buf->state != BUFFER_FREE) {
+            pthread_cond_wait(&sq->changed, &sq->mutex);
+        }
+        pthread_mutex_unlock(&sq->mutex);
+
+        size_t n = read_chunk(sq->fd, buf->input);
+
+        pthread_mutex_lock(&sq->mutex);
+        if (n == 0) {
+            sq->eof = 1;
+        } else {
+            buf->input_size = n;
+            buf->state = BUFFER_FILLED;
+            sq->chunks_read++;
+        }
+        pthread_cond_broadcast(&sq->changed);
+        pthread_mutex_unlock(&sq->mutex);
+
+        if (n == 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void *stream_worker(void *arg) {
+    StreamQueue *sq = (StreamQueue *)arg;
+
+    while (1) {
+        pthread_mutex_lock(&sq->mutex);
+        while (sq->chunks_claimed == sq->chunks_read && !sq->eof) {
+            pthread_cond_wait(&sq->changed, &sq->mutex);
+        }
+        if (sq->chunks_claimed == sq->chunks_read) {
+            pthread_mutex_unlock(&sq->mutex);
+            break;
+        }
+        ChunkBuffer *buf = &sq->buffers[sq->chunks_claimed % sq->num_buffers];
+        sq->chunks_claimed++;
+        pthread_mutex_unlock(&sq->mutex);
+
+        buf->output_size = compress_buffer(buf->input, buf->input_size, buf->output);
+
+        pthread_mutex_lock(&sq->mutex);
+        buf->state = BUFFER_COMPRESSED;
+        pthread_cond_broadcast(&sq->changed);
+        pthread_mutex_unlock(&sq->mutex);
+    }
+    return NULL;
+}
+
+// Compress a file descriptor that cannot be mapped (pipe, stdin, ...). A
+// reader thread fills a fixed pool of recycled chunk buffers, the workers
+// compress them, and the calling thread writes them out in chunk order and
+// returns each buffer to the reader.
+void compress_stream(int fd, FILE *out, int num_threads) {
+    StreamQueue sq = {
+        .fd = fd,
+        .num_buffers = num_threads * STREAM_BUFFERS_PER_THREAD,
+        .chunks_read = 0,
+        .chunks_claimed = 0,
+        .eof = 0
+    };
+    pthread_t reader;
+    pthread_t workers[num_threads];
+
+    sq.buffers = calloc(sq.num_buffers, sizeof(ChunkBuffer));
+    if (sq.buffers == NULL) {
+        perror("Error allocating buffers");
+        exit(1);
+    }
+    for (int b = 0; b < sq.num_buffers; b++) {
+        sq.buffers[b].input = malloc(CHUNK_SIZE);
+        sq.buffers[b].output = malloc(CHUNK_SIZE * 2 + 1);
+        if (sq.buffers[b].input == NULL || sq.buffers[b].output == NULL) {
+            perror("Error allocating buffers");
+            exit(1);
+        }
+        sq.buffers[b].state = BUFFER_FREE;
+    }
+    pthread_mutex_init(&sq.mutex, NULL);
+    pthread_cond_init(&sq.changed, NULL);
+
+    if (pthread_create(&reader, NULL, stream_reader, &sq) != 0) {
+        perror("Error creating thread");
+        exit(1);
+    }
+    for (int t = 0; t < num_threads; t++) {
+        if (pthread_create(&workers[t], NULL, stream_worker, &sq) != 0) {
+            perror("Error creating thread");
+            exit(1);
+        }
+    }
+
+    for (long chunk = 0; ; chunk++) {
+        ChunkBuffer *buf = &sq.buffers[chunk % sq.num_buffers];
+
+        pthread_mutex_lock(&sq.mutex);
+        while (buf->state != BUFFER_COMPRESSED && !(sq.eof && chunk == sq.chunks_read)) {
+            pthread_cond_wait(&sq.changed, &sq.mutex);
+        }
+        int done = buf->state != BUFFER_COMPRESSED;
+        pthread_mutex_unlock(&sq.mutex);
+        if (done) {
+            break;
+        }
+
+        write_compressed_data(out, buf->output, buf->output_size);
+
+        pthread_mutex_lock(&sq.mutex);
+        buf->state = BUFFER_FREE;
+        pthread_cond_broadcast(&sq.changed);
+        pthread_mutex_unlock(&sq.mutex);
+    }
+
+    pthread_join(reader, NULL);
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(workers[t], NULL);
+    }
+
+    pthread_cond_destroy(&sq.changed);
+    pthread_mutex_destroy(&sq.mutex);
+    for (int b = 0; b < sq.num_buffers; b++) {
+        free(sq.buffers[b].input);
+        free(sq.buffers[b].output);
+    }
+    free(sq.buffers);
+}
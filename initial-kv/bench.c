@@ -0,0 +1,87 @@
+// Micro-benchmark for the in-memory store: times put, get (hits and misses),
+// overwrite and delete over N keys (10 million by default), then the peak
+// resident set size.
+//
+//   prompt> make bench && ./bench [num_keys]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "db.h"
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char* phase, long ops, double seconds) {
+    printf("%-10s %10ld ops %8.3f s %10.1f ns/op %8.2f Mops/s\n",
+           phase, ops, seconds, seconds * 1e9 / ops, ops / seconds / 1e6);
+}
+
+// Scatter keys over the int range so that they are not inserted in order.
+static int key_of(long i) {
+    return (int)((unsigned)i * 2654435761u);
+}
+
+int main(int argc, char* argv[]) {
+    long n = argc > 1 ? atol(argv[1]) : 10000000;
+    char value[32];
+    char* buf = NULL;
+    size_t cap = 0;
+    long found = 0;
+    double start;
+
+    if (n <= 0) {
+        fprintf(stderr, "usage: bench [num_keys]\n");
+        return 1;
+    }
+
+    Database* db = init_database(16);
+
+    start = now();
+    for (long i = 0; i < n; i++) {
+        snprintf(value, sizeof(value), "value%ld", i);
+        put(db, key_of(i), value);
+    }
+    report("put", n, now() - start);
+
+    start = now();
+    for (long i = 0; i < n; i++) {
+        found += get(db, key_of(i), &buf, &cap);
+    }
+    report("get-hit", n, now() - start);
+
+    start = now();
+    for (long i = n; i < 2 * n; i++) {
+        found += get(db, key_of(i), &buf, &cap);
+    }
+    report("get-miss", n, now() - start);
+
+    start = now();
+    for (long i = 0; i < n; i++) {
+        put(db, key_of(i), "overwritten");
+    }
+    report("overwrite", n, now() - start);
+
+    start = now();
+    for (long i = 0; i < n; i += 2) {
+        found += delete(db, key_of(i));
+    }
+    report("delete", (n + 1) / 2, now() - start);
+
+    if (found != n + (n + 1) / 2) {
+        fprintf(stderr, "bench: unexpected result count %ld\n", found);
+        return 1;
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%-10s %10ld KB\n", "max-rss", usage.ru_maxrss);
+
+    free(buf);
+    free_database(db);
+    return 0;
+}
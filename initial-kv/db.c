@@ -0,0 +1,506 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include "db.h"
+#include "snap.h"
+#include "epoch.h"
+
+#define MIN_CAPACITY 16
+#define MAX_LOAD_PERCENT 80
+
+// Spread the bits of an integer key so that sequential keys do not cluster.
+// The low bits pick the slot, the high bits the shard.
+static inline uint64_t hash_key(int key) {
+    uint64_t h = (uint32_t)key;
+    h *= 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 32);
+}
+
+static inline Shard* shard_of(Database* db, uint64_t hash) {
+    return &db->shards[hash >> (64 - SHARD_BITS)];
+}
+
+static Table* alloc_table(size_t capacity) {
+    Table* table = calloc(1, sizeof(Table) + capacity * sizeof(KeyValue));
+    if (!table) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    table->capacity = capacity;
+    return table;
+}
+
+static bool in_table(int key, void* shard);
+
+// Initialize database
+Database* init_database(size_t initial_capacity) {
+    Database* db = aligned_alloc(64, sizeof(Database));
+    if (!db) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    size_t capacity = MIN_CAPACITY;
+    while (capacity * MAX_LOAD_PERCENT / 100 * SHARDS < initial_capacity) {
+        capacity *= 2;
+    }
+    for (int i = 0; i < SHARDS; i++) {
+        Shard* shard = &db->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->seq = 0;
+        shard->table = alloc_table(capacity);
+        shard->size = 0;
+        slab_init(&shard->slab);
+        keyindex_init(&shard->index, in_table, shard);
+    }
+    db->next_order = 0;
+    db->base = NULL;
+    db->base_cleared = false;
+    db->on_change = NULL;
+    db->change_arg = NULL;
+    return db;
+}
+
+void attach_snapshot(Database* db, const Snapshot* base) {
+    db->base = base;
+    db->base_cleared = false;
+    db->next_order = base->count;
+}
+
+void set_change_hook(Database* db, ChangeHook hook, void* arg) {
+    db->on_change = hook;
+    db->change_arg = arg;
+}
+
+static uint64_t next_order(Database* db) {
+    return __atomic_fetch_add(&db->next_order, 1, __ATOMIC_RELAXED);
+}
+
+// The base's entry for key, unless a clear has hidden the base.
+static const SnapEntry* base_find(Database* db, int key) {
+    bool cleared = __atomic_load_n(&db->base_cleared, __ATOMIC_RELAXED);
+    return db->base && !cleared ? snap_find(db->base, key) : NULL;
+}
+
+// A writer makes the sequence count odd while it changes its shard, so that
+// readers who overlap with it know to retry.
+static void write_begin(Shard* shard) {
+    __atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(Shard* shard) {
+    __atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Place an entry known not to be in the table. Robin Hood: whenever the entry
+// being placed is further from home than the resident, they swap, which keeps
+// probe sequences short and lets lookups stop early.
+static void insert_slot(Table* table, KeyValue entry, uint64_t hash) {
+    size_t mask = table->capacity - 1;
+    size_t i = hash & mask;
+    entry.dist = 1;
+
+    while (table->slots[i].dist != 0) {
+        if (table->slots[i].dist < entry.dist) {
+            KeyValue resident = table->slots[i];
+            table->slots[i] = entry;
+            entry = resident;
+        }
+        i = (i + 1) & mask;
+        entry.dist++;
+    }
+    table->slots[i] = entry;
+}
+
+// Readers may still be probing the old table, so it is retired, not freed.
+static void grow(Shard* shard) {
+    Table* old = shard->table;
+    Table* table = alloc_table(old->capacity * 2);
+    for (size_t i = 0; i < old->capacity; i++) {
+        if (old->slots[i].dist != 0) {
+            insert_slot(table, old->slots[i], hash_key(old->slots[i].key));
+        }
+    }
+    __atomic_store_n(&shard->table, table, __ATOMIC_RELEASE);
+    epoch_retire(old);
+}
+
+static void make_room(Shard* shard) {
+    if ((shard->size + 1) * 100 > shard->table->capacity * MAX_LOAD_PERCENT) {
+        grow(shard);
+    }
+}
+
+// The slot holding key, or NULL. Readers may see a table in the middle of a
+// change, so the probe is bounded by the capacity rather than trusting that
+// it will reach an empty slot.
+static KeyValue* find_slot(Table* table, int key, uint64_t hash) {
+    size_t mask = table->capacity - 1;
+    size_t i = hash & mask;
+
+    for (uint32_t dist = 1; dist <= table->capacity; dist++) {
+        KeyValue* slot = &table->slots[i];
+        // An empty slot, or one closer to home than we are, ends the probe.
+        if (slot->dist < dist) {
+            return NULL;
+        }
+        if (slot->key == key) {
+            return slot;
+        }
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+// Large values are not in a slab page and may still be being read.
+static void retire(void* ptr) {
+    epoch_retire(ptr);
+}
+
+// Whether the shard's table still holds key, for its index.
+static bool in_table(int key, void* shard) {
+    Table* table = ((Shard*)shard)->table;
+    return find_slot(table, key, hash_key(key)) != NULL;
+}
+
+// Function to add or update key-value pair. A new value that needs the same
+// size class as the old one is written over it in place.
+void put(Database* db, int key, const char* value) {
+    size_t len = strlen(value);
+    uint64_t hash = hash_key(key);
+    Shard* shard = shard_of(db, hash);
+    pthread_mutex_lock(&shard->lock);
+    KeyValue* slot = find_slot(shard->table, key, hash);
+    const SnapEntry* entry = slot ? NULL : base_find(db, key);
+
+    write_begin(shard);
+    Value* stored;
+    if (slot && slot->value && slab_replace(&shard->slab, slot->value, value, len)) {
+        stored = slot->value;
+    } else if (slot) {
+        if (slot->value == NULL) {
+            slot->order = next_order(db); // Re-inserted after a delete
+        } else {
+            slab_release(&shard->slab, slot->value, retire);
+        }
+        stored = slab_store(&shard->slab, value, len);
+        __atomic_store_n(&slot->value, stored, __ATOMIC_RELAXED);
+    } else {
+        // Updating a base key keeps its place in the listing.
+        uint64_t order = entry ? entry->order : next_order(db);
+        stored = slab_store(&shard->slab, value, len);
+        make_room(shard);
+        insert_slot(shard->table, (KeyValue){ .key = key, .value = stored, .order = order }, hash);
+        keyindex_add(&shard->index, key);
+        shard->size++;
+    }
+
+    write_end(shard);
+    if (db->on_change) {
+        db->on_change(db->change_arg, DB_PUT, key, stored->data);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// The value may be rewritten while it is copied, so the copy is bounded by
+// the chunk's capacity, not by a NUL; a torn copy is retried by get().
+static void copy_out(const char* value, size_t len, char** buf, size_t* cap) {
+    if (len + 1 > *cap) {
+        char* bigger = realloc(*buf, len + 1);
+        if (!bigger) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        *buf = bigger;
+        *cap = len + 1;
+    }
+    memcpy(*buf, value, len);
+    (*buf)[len] = '\0';
+}
+
+// Function to get a value by key. Optimistic: look the key up and copy the
+// value without any lock, then check that no writer touched the shard in the
+// meantime. The epoch keeps a table or large value we saw from being freed
+// under us.
+bool get(Database* db, int key, char** buf, size_t* cap) {
+    uint64_t hash = hash_key(key);
+    Shard* shard = shard_of(db, hash);
+    bool found;
+
+    epoch_enter();
+    for (;;) {
+        unsigned seq = __atomic_load_n(&shard->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield(); // A writer is busy with this shard
+            continue;
+        }
+
+        Table* table = __atomic_load_n(&shard->table, __ATOMIC_ACQUIRE);
+        KeyValue* slot = find_slot(table, key, hash);
+        if (slot) {
+            Value* v = __atomic_load_n(&slot->value, __ATOMIC_RELAXED);
+            found = v != NULL;
+            if (found) {
+                size_t len = __atomic_load_n(&v->len, __ATOMIC_RELAXED);
+                copy_out(v->data, len < v->cap ? len : v->cap - 1, buf, cap);
+            }
+        } else {
+            const SnapEntry* entry = base_find(db, key);
+            found = entry != NULL;
+            if (found) {
+                copy_out(snap_value(db->base, entry), entry->len, buf, cap);
+            }
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shard->seq, __ATOMIC_RELAXED) == seq) {
+            break;
+        }
+    }
+    epoch_exit();
+    return found;
+}
+
+// Backward-shift deletion: the entries after the hole move one slot closer to
+// home, so the table itself needs no tombstones.
+static void remove_slot(Shard* shard, KeyValue* slot) {
+    Table* table = shard->table;
+    size_t mask = table->capacity - 1;
+    size_t i = slot - table->slots;
+    size_t next = (i + 1) & mask;
+    while (table->slots[next].dist > 1) {
+        table->slots[i] = table->slots[next];
+        table->slots[i].dist--;
+        i = next;
+        next = (next + 1) & mask;
+    }
+    memset(&table->slots[i], 0, sizeof(KeyValue));
+    shard->size--;
+    keyindex_removed(&shard->index);
+}
+
+// Function to delete a key-value pair. Keys that live in the base snapshot
+// are hidden by a NULL value instead.
+bool delete(Database* db, int key) {
+    uint64_t hash = hash_key(key);
+    Shard* shard = shard_of(db, hash);
+    bool deleted = true;
+
+    pthread_mutex_lock(&shard->lock);
+    KeyValue* slot = find_slot(shard->table, key, hash);
+    bool in_base = base_find(db, key) != NULL;
+
+    if (slot ? slot->value == NULL : !in_base) {
+        deleted = false; // Not there, or already deleted
+    } else {
+        write_begin(shard);
+        if (slot) {
+            slab_release(&shard->slab, slot->value, retire);
+            if (in_base) {
+                __atomic_store_n(&slot->value, NULL, __ATOMIC_RELAXED);
+            } else {
+                remove_slot(shard, slot);
+            }
+        } else {
+            make_room(shard);
+            insert_slot(shard->table, (KeyValue){ .key = key, .value = NULL }, hash);
+            keyindex_add(&shard->index, key);
+            shard->size++;
+        }
+        write_end(shard);
+        if (db->on_change) {
+            db->on_change(db->change_arg, DB_DELETE, key, NULL);
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return deleted;
+}
+
+void db_freeze(Database* db) {
+    for (int i = 0; i < SHARDS; i++) {
+        pthread_mutex_lock(&db->shards[i].lock);
+    }
+}
+
+void db_thaw(Database* db) {
+    for (int i = SHARDS - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&db->shards[i].lock);
+    }
+}
+
+// The child's copies of the locks are held on behalf of a thread that does
+// not exist in it, so they are made anew.
+void db_thaw_child(Database* db) {
+    for (int i = 0; i < SHARDS; i++) {
+        pthread_mutex_init(&db->shards[i].lock, NULL);
+    }
+}
+
+void clear(Database* db) {
+    db_freeze(db);
+    for (int i = 0; i < SHARDS; i++) {
+        Shard* shard = &db->shards[i];
+        Table* table = shard->table;
+        write_begin(shard);
+        for (size_t j = 0; j < table->capacity; j++) {
+            if (table->slots[j].dist != 0 && table->slots[j].value != NULL) {
+                slab_release(&shard->slab, table->slots[j].value, retire);
+            }
+        }
+        memset(table->slots, 0, sizeof(KeyValue) * table->capacity);
+        keyindex_clear(&shard->index);
+        shard->size = 0;
+    }
+    __atomic_store_n(&db->base_cleared, true, __ATOMIC_RELAXED);
+    for (int i = 0; i < SHARDS; i++) {
+        write_end(&db->shards[i]);
+    }
+    if (db->on_change) {
+        db->on_change(db->change_arg, DB_CLEAR, 0, NULL);
+    }
+    db_thaw(db);
+}
+
+// No reader may be active any more, so everything is freed directly.
+void free_database(Database* db) {
+    if (db == NULL) {
+        return;
+    }
+    for (int i = 0; i < SHARDS; i++) {
+        Shard* shard = &db->shards[i];
+        Table* table = shard->table;
+        for (size_t j = 0; j < table->capacity; j++) {
+            if (table->slots[j].dist != 0 && table->slots[j].value != NULL) {
+                slab_release(&shard->slab, table->slots[j].value, free);
+            }
+        }
+        slab_free_all(&shard->slab);
+        keyindex_free(&shard->index);
+        free(table);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    epoch_drain();
+    free(db);
+}
+
+void db_stats(Database* db, DbStats* stats) {
+    memset(stats, 0, sizeof(DbStats));
+    for (int i = 0; i < SHARDS; i++) {
+        Shard* shard = &db->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->keys += shard->size;
+        stats->table_bytes += sizeof(Table) + shard->table->capacity * sizeof(KeyValue);
+        KeyIndex* index = &shard->index;
+        stats->index_bytes += (index->cap + index->spare_cap + index->delta_cap) * sizeof(int);
+        slab_stats(&shard->slab, &stats->values);
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+typedef struct {
+    uint64_t order;
+    int key;
+    const char* value;
+} Listed;
+
+static int compare_order(const void* a, const void* b) {
+    uint64_t x = ((const Listed*)a)->order;
+    uint64_t y = ((const Listed*)b)->order;
+    return (x > y) - (x < y);
+}
+
+// Lists the base's pairs that the tables do not override, together with the
+// tables' live pairs.
+void for_each(Database* db, void (*fn)(int key, const char* value, void* arg), void* arg) {
+    size_t base_count = db->base && !db->base_cleared ? db->base->count : 0;
+    size_t size = 0;
+    for (int i = 0; i < SHARDS; i++) {
+        size += db->shards[i].size;
+    }
+    Listed* sorted = malloc(sizeof(Listed) * (size + base_count + 1));
+    if (!sorted) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < base_count; i++) {
+        const SnapEntry* entry = &db->base->index[i];
+        uint64_t hash = hash_key(entry->key);
+        if (find_slot(shard_of(db, hash)->table, entry->key, hash) == NULL) {
+            sorted[n++] = (Listed){ entry->order, entry->key, snap_value(db->base, entry) };
+        }
+    }
+    for (int i = 0; i < SHARDS; i++) {
+        Table* table = db->shards[i].table;
+        for (size_t j = 0; j < table->capacity; j++) {
+            KeyValue* slot = &table->slots[j];
+            if (slot->dist != 0 && slot->value != NULL) {
+                sorted[n++] = (Listed){ slot->order, slot->key, slot->value->data };
+            }
+        }
+    }
+    qsort(sorted, n, sizeof(Listed), compare_order);
+
+    for (size_t i = 0; i < n; i++) {
+        fn(sorted[i].key, sorted[i].value, arg);
+    }
+    free(sorted);
+}
+
+// Merges the shards' indexes with the base, which is sorted already. A key
+// may come up in several of them (in the base and as a change on top of it,
+// or twice in one index, see keyindex.h); the table decides what it holds.
+void range(Database* db, int lo, int hi, void (*fn)(int key, const char* value, void* arg),
+           void* arg) {
+    KeyCursor cursors[SHARDS];
+    int heads[SHARDS];
+    bool more[SHARDS];
+    for (int i = 0; i < SHARDS; i++) {
+        keyindex_seek(&db->shards[i].index, lo, &cursors[i]);
+        more[i] = keycursor_next(&cursors[i], &heads[i]);
+    }
+    const Snapshot* base = db->base && !db->base_cleared ? db->base : NULL;
+    size_t b = base ? snap_lower_bound(base, lo) : 0;
+    size_t base_count = base ? base->count : 0;
+
+    for (;;) {
+        bool found = false;
+        int key = 0;
+        if (b < base_count) {
+            key = base->index[b].key;
+            found = true;
+        }
+        for (int i = 0; i < SHARDS; i++) {
+            if (more[i] && (!found || heads[i] < key)) {
+                key = heads[i];
+                found = true;
+            }
+        }
+        if (!found || key > hi) {
+            break;
+        }
+
+        const SnapEntry* entry = NULL;
+        if (b < base_count && base->index[b].key == key) {
+            entry = &base->index[b++];
+        }
+        for (int i = 0; i < SHARDS; i++) {
+            while (more[i] && heads[i] == key) {
+                more[i] = keycursor_next(&cursors[i], &heads[i]);
+            }
+        }
+
+        uint64_t hash = hash_key(key);
+        KeyValue* slot = find_slot(shard_of(db, hash)->table, key, hash);
+        if (slot) {
+            if (slot->value != NULL) {
+                fn(key, slot->value->data, arg);
+            }
+        } else if (entry) {
+            fn(key, snap_value(base, entry), arg);
+        }
+    }
+}
@@ -0,0 +1,108 @@
+#ifndef __db_h__
+#define __db_h__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "slab.h"
+#include "keyindex.h"
+
+// Read-only snapshot the database can be layered on (snap.h).
+typedef struct Snapshot Snapshot;
+
+// One slot of the hash table. Slots are kept in an open-addressing table with
+// Robin Hood probing: dist is the slot's distance from its home bucket plus
+// one, so that 0 marks an empty slot.
+typedef struct {
+    int key;
+    uint32_t dist;
+    Value* value;       // In the shard's slab; NULL deletes the base's key
+    uint64_t order;     // Insertion stamp; keeps listings in insertion order
+} KeyValue;
+
+// A table and its size are allocated together so that lock-free readers can
+// never pair a new table with an old capacity.
+typedef struct {
+    size_t capacity;    // a power of two
+    KeyValue slots[];
+} Table;
+
+// Keys are spread over SHARDS independent tables by hash. Writers lock their
+// shard; readers take no lock at all but retry if the shard's sequence count
+// changed (or was odd, i.e. a write was in progress) while they copied the
+// value out. Tables a writer replaces are only freed once no reader can
+// still be looking at them (epoch.h); values live in the shard's own slab
+// (slab.h), whose chunks stay valid memory when they are reused. Each shard
+// also keeps its keys in order (keyindex.h), for range scans.
+#define SHARD_BITS 4
+#define SHARDS (1 << SHARD_BITS)
+
+typedef struct {
+    pthread_mutex_t lock;
+    unsigned seq;
+    Table* table;
+    size_t size;
+    Slab slab;
+    KeyIndex index;
+} __attribute__((aligned(64))) Shard;
+
+// Mutations can be reported as they are made, under the shard lock, so that
+// e.g. a log sees them in the same order as the database does.
+enum { DB_PUT = 1, DB_DELETE = 2, DB_CLEAR = 3 };
+typedef void (*ChangeHook)(void* arg, int op, int key, const char* value);
+
+// Structure for database. The hash tables hold every change made on top of
+// an optional base snapshot: new and updated pairs, and tombstones (NULL
+// values) for deleted base keys. Once cleared, the base is hidden entirely.
+typedef struct {
+    Shard shards[SHARDS];
+    uint64_t next_order;
+    const Snapshot* base;
+    bool base_cleared;
+    ChangeHook on_change;
+    void* change_arg;
+} Database;
+
+typedef struct {
+    size_t keys;            // pairs and tombstones held in the tables
+    size_t table_bytes;
+    size_t index_bytes;
+    SlabStats values;
+} DbStats;
+
+Database* init_database(size_t initial_capacity);
+void free_database(Database* db);
+
+// Layer db, which must be empty, on top of base. base must outlive db.
+void attach_snapshot(Database* db, const Snapshot* base);
+void set_change_hook(Database* db, ChangeHook hook, void* arg);
+
+// Add or update a key-value pair; the value is copied.
+void put(Database* db, int key, const char* value);
+// Copy the value stored for key into *buf, which is grown with realloc() as
+// needed. Returns false if key is not present. Never blocks on writers.
+bool get(Database* db, int key, char** buf, size_t* cap);
+// Returns true if key was present.
+bool delete(Database* db, int key);
+void clear(Database* db);
+// Memory used by the tables and the values, shard by shard.
+void db_stats(Database* db, DbStats* stats);
+
+// Call fn for every pair, in the order the keys were first inserted. If other
+// threads may be writing, the caller must hold the database frozen.
+void for_each(Database* db, void (*fn)(int key, const char* value, void* arg), void* arg);
+// Call fn for every pair with lo <= key <= hi, in key order. Takes
+// O(log n + k) for k pairs, plus sorting what was inserted since the last
+// range. The same rule about freezing applies.
+void range(Database* db, int lo, int hi, void (*fn)(int key, const char* value, void* arg),
+           void* arg);
+
+// Hold every shard's lock, to keep writers out during for_each() or to fork()
+// a consistent copy. A child forked while the database may have been frozen
+// must call db_thaw_child() before it uses the database.
+void db_freeze(Database* db);
+void db_thaw(Database* db);
+void db_thaw_child(Database* db);
+
+#endif // __db_h__
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "epoch.h"
+
+#define RECLAIM_EVERY 64        // retires between attempts to free memory
+
+// One per thread that has ever read; records are reused, never freed.
+typedef struct Reader {
+    uint64_t epoch;             // global epoch seen on entry, 0 when outside
+    int in_use;
+    struct Reader* next;
+} __attribute__((aligned(64))) Reader;
+
+typedef struct {
+    void* ptr;
+    uint64_t epoch;             // global epoch when it was retired
+} Retired;
+
+typedef struct {
+    Retired* items;
+    size_t len;
+    size_t cap;
+} Limbo;
+
+static uint64_t global_epoch = 1;
+static Reader* readers;
+
+// Memory retired by threads that exited before it could be freed.
+static pthread_mutex_t orphan_lock = PTHREAD_MUTEX_INITIALIZER;
+static Limbo orphans;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+
+static __thread Reader* self;
+static __thread Limbo limbo;
+static __thread unsigned retires;
+
+static void push(Limbo* l, void* ptr, uint64_t epoch) {
+    if (l->len == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 256;
+        l->items = realloc(l->items, l->cap * sizeof(Retired));
+        if (!l->items) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+    }
+    l->items[l->len++] = (Retired){ ptr, epoch };
+}
+
+// Free what no reader can reach any more, i.e. what was retired at least two
+// epochs before the current one.
+static void reclaim(Limbo* l, uint64_t epoch) {
+    size_t kept = 0;
+    for (size_t i = 0; i < l->len; i++) {
+        if (l->items[i].epoch + 2 <= epoch) {
+            free(l->items[i].ptr);
+        } else {
+            l->items[kept++] = l->items[i];
+        }
+    }
+    l->len = kept;
+}
+
+static void thread_exit(void* unused) {
+    (void)unused;
+    if (self) {
+        __atomic_store_n(&self->in_use, 0, __ATOMIC_RELEASE);
+        self = NULL;
+    }
+    pthread_mutex_lock(&orphan_lock);
+    for (size_t i = 0; i < limbo.len; i++) {
+        push(&orphans, limbo.items[i].ptr, limbo.items[i].epoch);
+    }
+    pthread_mutex_unlock(&orphan_lock);
+    free(limbo.items);
+    limbo = (Limbo){ 0 };
+}
+
+static void make_key(void) {
+    pthread_key_create(&thread_key, thread_exit);
+}
+
+// Arrange for thread_exit to run when this thread ends.
+static void register_thread(void) {
+    pthread_once(&key_once, make_key);
+    pthread_setspecific(thread_key, &limbo);
+}
+
+static Reader* acquire_reader(void) {
+    register_thread();
+    for (Reader* r = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); r; r = r->next) {
+        int free_slot = 0;
+        if (__atomic_compare_exchange_n(&r->in_use, &free_slot, 1, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            return r;
+        }
+    }
+
+    Reader* r = aligned_alloc(sizeof(Reader), sizeof(Reader));
+    if (!r) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    r->epoch = 0;
+    r->in_use = 1;
+    r->next = __atomic_load_n(&readers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&readers, &r->next, r, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    return r;
+}
+
+void epoch_enter(void) {
+    if (!self) {
+        self = acquire_reader();
+    }
+    __atomic_store_n(&self->epoch, __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE),
+                     __ATOMIC_RELAXED);
+    // The announcement must be visible before any shared pointer is read.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(void) {
+    __atomic_store_n(&self->epoch, 0, __ATOMIC_RELEASE);
+}
+
+// Move to the next epoch if every reader inside a critical section has seen
+// the current one. Returns the (possibly new) global epoch.
+static uint64_t try_advance(void) {
+    uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (Reader* r = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); r; r = r->next) {
+        uint64_t seen = __atomic_load_n(&r->epoch, __ATOMIC_ACQUIRE);
+        if (seen != 0 && seen != epoch) {
+            return epoch;
+        }
+    }
+    __atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, false,
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+}
+
+void epoch_retire(void* ptr) {
+    if (limbo.items == NULL) {
+        register_thread();
+    }
+    push(&limbo, ptr, __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE));
+
+    if (++retires % RECLAIM_EVERY == 0) {
+        uint64_t epoch = try_advance();
+        reclaim(&limbo, epoch);
+        if (__atomic_load_n(&orphans.len, __ATOMIC_RELAXED) != 0) {
+            pthread_mutex_lock(&orphan_lock);
+            reclaim(&orphans, epoch);
+            pthread_mutex_unlock(&orphan_lock);
+        }
+    }
+}
+
+void epoch_drain(void) {
+    reclaim(&limbo, UINT64_MAX);
+    pthread_mutex_lock(&orphan_lock);
+    reclaim(&orphans, UINT64_MAX);
+    pthread_mutex_unlock(&orphan_lock);
+}
@@ -0,0 +1,17 @@
+#ifndef __epoch_h__
+#define __epoch_h__
+
+// Epoch-based reclamation. Readers that follow pointers without taking a lock
+// bracket the access with epoch_enter()/epoch_exit(); writers hand memory they
+// have unlinked to epoch_retire() instead of free(). Retired memory is freed
+// once every reader that might still see it has left its critical section:
+// the global epoch only advances when all active readers have observed it, so
+// anything retired two epochs ago is unreachable.
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void* ptr);
+
+// Free everything retired so far. Only safe when no reader is active.
+void epoch_drain(void);
+
+#endif // __epoch_h__
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "keyindex.h"
+
+#define MIN_DELTA 64
+
+static int* grow_array(int* array, size_t cap) {
+    array = realloc(array, cap * sizeof(int));
+    if (!array) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    return array;
+}
+
+// First position in array[0..len) whose key is at least key.
+static size_t lower_bound(const int* array, size_t len, int key) {
+    size_t lo = 0, hi = len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (array[mid] < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int compare_int(const void* a, const void* b) {
+    int x = *(const int*)a;
+    int y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+// The delta is kept at a few times the square root of the array: merges copy
+// the array once per delta's worth of inserts, and a scan sorts the delta.
+static size_t delta_size(size_t len) {
+    size_t size = MIN_DELTA;
+    while (size * size < len * 16) {
+        size *= 2;
+    }
+    return size;
+}
+
+static void sort_delta(KeyIndex* index) {
+    if (!index->delta_sorted) {
+        qsort(index->delta, index->delta_len, sizeof(int), compare_int);
+        index->delta_sorted = true;
+    }
+}
+
+void keyindex_init(KeyIndex* index, bool (*live)(int key, void* arg), void* arg) {
+    memset(index, 0, sizeof(KeyIndex));
+    index->delta_cap = MIN_DELTA;
+    index->delta = grow_array(NULL, index->delta_cap);
+    index->delta_sorted = true;
+    index->live = live;
+    index->live_arg = arg;
+}
+
+void keyindex_free(KeyIndex* index) {
+    free(index->keys);
+    free(index->spare);
+    free(index->delta);
+    memset(index, 0, sizeof(KeyIndex));
+}
+
+// Merge the delta into the array, dropping duplicates left behind by a
+// removal and re-insertion. Asking live() about every key costs a hash probe
+// each, so removed keys are only filtered out once they are an eighth of the
+// index, which keeps that O(1) per removal.
+static void merge(KeyIndex* index) {
+    size_t total = index->len + index->delta_len;
+    bool filter = index->stale * 8 > total;
+    if (index->spare_cap < total) {
+        index->spare_cap = total * 2;
+        free(index->spare);
+        index->spare = grow_array(NULL, index->spare_cap);
+    }
+    sort_delta(index);
+
+    int* merged = index->spare;
+    size_t n = 0, i = 0, j = 0;
+    while (i < index->len || j < index->delta_len) {
+        int key;
+        if (j == index->delta_len || (i < index->len && index->keys[i] <= index->delta[j])) {
+            key = index->keys[i++];
+        } else {
+            key = index->delta[j++];
+        }
+        if ((n == 0 || merged[n - 1] != key) && (!filter || index->live(key, index->live_arg))) {
+            merged[n++] = key;
+        }
+    }
+
+    index->spare = index->keys;
+    index->keys = merged;
+    size_t cap = index->cap;
+    index->cap = index->spare_cap;
+    index->spare_cap = cap;
+    index->len = n;
+    index->delta_len = 0;
+    if (filter) {
+        index->stale = 0;
+    }
+    size_t size = delta_size(n);
+    if (size != index->delta_cap) {
+        index->delta_cap = size;
+        index->delta = grow_array(index->delta, size);
+    }
+}
+
+void keyindex_add(KeyIndex* index, int key) {
+    if (index->delta_len == index->delta_cap) {
+        merge(index);
+    }
+    if (index->delta_len > 0 && index->delta[index->delta_len - 1] > key) {
+        index->delta_sorted = false;
+    }
+    index->delta[index->delta_len++] = key;
+}
+
+void keyindex_removed(KeyIndex* index) {
+    index->stale++;
+    if (index->stale * 2 > index->len + index->delta_len && index->stale > MIN_DELTA) {
+        merge(index);
+    }
+}
+
+void keyindex_clear(KeyIndex* index) {
+    index->len = 0;
+    index->delta_len = 0;
+    index->delta_sorted = true;
+    index->stale = 0;
+}
+
+void keyindex_seek(KeyIndex* index, int lo, KeyCursor* cur) {
+    sort_delta(index);
+    cur->keys = index->keys;
+    cur->len = index->len;
+    cur->i = lower_bound(index->keys, index->len, lo);
+    cur->delta = index->delta;
+    cur->delta_len = index->delta_len;
+    cur->j = lower_bound(index->delta, index->delta_len, lo);
+}
+
+bool keycursor_next(KeyCursor* cur, int* key) {
+    if (cur->i < cur->len && (cur->j == cur->delta_len || cur->keys[cur->i] <= cur->delta[cur->j])) {
+        *key = cur->keys[cur->i++];
+        return true;
+    }
+    if (cur->j < cur->delta_len) {
+        *key = cur->delta[cur->j++];
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,53 @@
+#ifndef __keyindex_h__
+#define __keyindex_h__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Ordered index of the keys in one hash table: a sorted array, plus a small
+// delta buffer that new keys are appended to. The delta is sorted when it is
+// scanned or fills up; a full delta is merged into the array, so an insert
+// costs O(sqrt n) moves amortized while a scan stays a walk over two
+// contiguous arrays.
+//
+// Removed keys are not taken out at once but dropped, by asking live(), at a
+// later merge; one is forced once they make up half of the index. Until then
+// a cursor may return keys that are no longer in the table, and the same key
+// twice.
+typedef struct {
+    int* keys;
+    size_t len;
+    size_t cap;
+    int* spare;             // merges go here, then it swaps with keys
+    size_t spare_cap;
+    int* delta;
+    size_t delta_len;
+    size_t delta_cap;
+    bool delta_sorted;
+    size_t stale;           // removed keys still in keys or delta
+    bool (*live)(int key, void* arg);
+    void* live_arg;
+} KeyIndex;
+
+typedef struct {
+    const int* keys;
+    size_t i, len;
+    const int* delta;
+    size_t j, delta_len;
+} KeyCursor;
+
+void keyindex_init(KeyIndex* index, bool (*live)(int key, void* arg), void* arg);
+void keyindex_free(KeyIndex* index);
+// key must not be live in the index already.
+void keyindex_add(KeyIndex* index, int key);
+// A key was removed from the table.
+void keyindex_removed(KeyIndex* index);
+void keyindex_clear(KeyIndex* index);
+
+// Position cur at the first key that is at least lo; keycursor_next() then
+// returns keys in ascending order until it returns false, or until the index
+// is changed.
+void keyindex_seek(KeyIndex* index, int lo, KeyCursor* cur);
+bool keycursor_next(KeyCursor* cur, int* key);
+
+#endif // __keyindex_h__
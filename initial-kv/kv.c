@@ -2,154 +2,713 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "db.h"
+#include "wal.h"
+#include "snap.h"
 
-#define MAX_KEY 100 
-#define FILENAME "database.txt"
+// On disk the database is a binary snapshot (snap.h) plus the log of
+// mutations made since: startup maps the snapshot and replays the log on top
+// of it, and commands only append to the log. Once the log outgrows the
+// snapshot, a background child folds it into a new snapshot (see
+// maybe_compact). The old text format is still read if there is no snapshot
+// yet, and the i and e commands import and export it.
+#define FILENAME "database.snap"
+#define SNAPSHOT_TMP "database.snap.tmp"
+#define TEXTFILE "database.txt"
+#define LOGFILE "database.log"
+#define COMPACTING "database.log.compacting"    // log being folded into the snapshot
+#define LOCKFILE "database.lock"
 
-// Structure for key-value pair
-typedef struct {
-    int key; 
-    char* value; // Dynamic memory for value
-} KeyValue; 
+#ifndef COMPACT_MIN_BYTES
+#define COMPACT_MIN_BYTES (1 << 20)
+#endif
 
-// Structure for database 
 typedef struct {
-    KeyValue* items; 
-    int capacity;
-    int size; 
-} Database; 
-
-// Initialize database 
-Database* init_database(int initial_capacity) {
-    Database* db = malloc(sizeof(Database));
-    if (!db) {
-        fprintf(stderr, "Memory allocation failed\n");
+    char* data;
+    size_t len;
+    size_t cap;
+} Buffer;
+
+static void print_pair(int key, const char* value, void* arg) {
+    fprintf((FILE*)arg, "%d,%s\n", key, value);
+}
+
+// Function to print all key-value pairs
+void print_all(Database* db, FILE* out) {
+    db_freeze(db);
+    for_each(db, print_pair, out);
+    db_thaw(db);
+}
+
+// Function to export the database as text, one "key,value" line per pair
+void save_to_file(Database* db, const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Failed to open file for writing\n");
+        return;
+    }
+
+    db_freeze(db);
+    for_each(db, print_pair, file);
+    db_thaw(db);
+    fclose(file);
+}
+
+// Function to print memory accounting: the tables, then the values by slab
+// class (only classes that have pages), then the totals.
+void print_stats(Database* db, FILE* out) {
+    DbStats stats;
+    db_stats(db, &stats);
+
+    size_t slab_bytes = 0;
+    for (int i = 0; i < slab_class_count(); i++) {
+        if (stats.values.pages[i] == 0) {
+            continue;
+        }
+        size_t size = slab_chunk_size(i);
+        fprintf(out, "class %d chunk %zu pages %zu used %zu of %zu\n", i, size,
+                stats.values.pages[i], stats.values.used[i],
+                stats.values.pages[i] * (SLAB_PAGE_SIZE / size));
+        slab_bytes += stats.values.pages[i] * SLAB_PAGE_SIZE;
+    }
+    fprintf(out, "keys %zu\n", stats.keys);
+    fprintf(out, "table_bytes %zu\n", stats.table_bytes);
+    fprintf(out, "index_bytes %zu\n", stats.index_bytes);
+    fprintf(out, "value_bytes %zu\n", stats.values.value_bytes);
+    fprintf(out, "slab_bytes %zu\n", slab_bytes);
+    fprintf(out, "large_values %zu\n", stats.values.large);
+    fprintf(out, "large_bytes %zu\n", stats.values.large_bytes);
+}
+
+// Function to print the pairs with lo <= key <= hi in key order
+void print_range(Database* db, int lo, int hi, FILE* out) {
+    db_freeze(db);
+    range(db, lo, hi, print_pair, out);
+    db_thaw(db);
+}
+
+static void install_snapshot(void) {
+    if (rename(SNAPSHOT_TMP, FILENAME) < 0) {
+        perror("kv: " FILENAME);
         exit(1);
     }
-    db->items = malloc(sizeof(KeyValue) * initial_capacity);
-    if (!db->items) {
-        fprintf(stderr, "Memory allocation failed\n");
-        free(db);
+    sync_dir();
+}
+
+// Function to load text from a file. Returns false if the file can't be
+// opened.
+bool load_from_file(Database* db, const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return false;
+    }
+
+    // Each line is "key,value"; the value is parsed in place rather than
+    // copied into a temporary buffer, and put() is O(1), so loading is O(n).
+    char* line = NULL;
+    size_t len = 0;
+    ssize_t read;
+    while ((read = getline(&line, &len, file)) != -1) {
+        char* end;
+        long key = strtol(line, &end, 10);
+        if (end == line || *end != ',') {
+            continue;
+        }
+        char* value = end + 1;
+        if (read > 0 && line[read - 1] == '\n') {
+            line[read - 1] = '\0';
+        }
+        if (*value != '\0') {
+            put(db, (int)key, value);
+        }
+    }
+    free(line); // Free the line buffer
+    fclose(file);
+    return true;
+}
+
+// All invocations serialize on LOCKFILE: readers share it, and anything that
+// appends to the log or swaps snapshots holds it exclusively.
+static int lock_database(int operation) {
+    int fd = open(LOCKFILE, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || flock(fd, operation) < 0) {
+        perror("kv: " LOCKFILE);
         exit(1);
     }
+    return fd;
+}
 
-    db->capacity = initial_capacity; 
-    db->size = 0; 
-    return db;
+static bool is_mutation(const char* token) {
+    return ((token[0] == 'p' || token[0] == 'd' || token[0] == 'i') && token[1] == ',') ||
+        strcmp(token, "c") == 0;
 }
 
-// Function to add or update key-value pair 
-void put(Database* db, int key, const char* value) {
-    // Check if key exists 
-    for (int i = 0; i < db->size; i++) {
-        if (db->items[i].key == key) {
-            free(db->items[i].value); // Free the old value
-            db->items[i].value = strdup(value); // Duplicate the new value
-            return;
+// Commands that name a file on the machine kv runs on: import and export.
+static bool is_file_command(const char* token) {
+    return (token[0] == 'i' || token[0] == 'e') && token[1] == ',';
+}
+
+// Fold the log into a new snapshot once it is at least as big as the snapshot
+// itself, so that compaction costs O(1) amortized per logged byte. The log is
+// renamed to COMPACTING and a child writes the snapshot in the background;
+// meanwhile later invocations load the old snapshot, replay COMPACTING and
+// then start a fresh log. The child swaps the snapshot in and removes
+// COMPACTING under the exclusive lock, so every invocation sees either the old
+// snapshot plus both logs or the new snapshot plus the fresh log. A database
+// still in the text format is converted on its first logged change.
+//
+// Returns true if the log was moved away, in which case wal starts afresh. A
+// server keeps the lock for its lifetime, so its child keeps holding it too;
+// it also keeps writers out by freezing the database around the call.
+static bool maybe_compact(Database* db, Wal* wal, int lock, bool server) {
+    struct stat st;
+    if (stat(FILENAME, &st) == 0) {
+        if (wal->size < COMPACT_MIN_BYTES || wal->size < st.st_size) {
+            return false;
         }
+    } else if (wal->size == 0 || (wal->size < COMPACT_MIN_BYTES && access(TEXTFILE, F_OK) != 0)) {
+        return false;
     }
 
-    // If key doesn't exist, add new item
-    if (db->size >= db->capacity) {
-        // Resize database if needed 
-        db->capacity *= 2; 
-        db->items = realloc(db->items, sizeof(KeyValue) * db->capacity);
-        if (!db->items) {
-            fprintf(stderr, "Memory reallocation failed\n");
-            exit(1);
+    // The child holds a lock on COMPACTING for as long as it runs. If it is
+    // gone without removing the file it died, and we redo its work here.
+    int compacting = open(COMPACTING, O_RDONLY);
+    if (compacting >= 0) {
+        if (flock(compacting, LOCK_EX | LOCK_NB) < 0) {
+            close(compacting);      // still running
+            return false;
         }
+        bool done = snap_write(db, SNAPSHOT_TMP);
+        if (done) {
+            install_snapshot();
+            unlink(COMPACTING);
+            unlink(LOGFILE);
+            sync_dir();
+            wal_close(wal);
+        }
+        close(compacting);
+        return done;
+    }
+
+    if (rename(LOGFILE, COMPACTING) < 0) {
+        perror("kv: " LOGFILE);
+        return false;
+    }
+    sync_dir();
+    wal_close(wal);
+    compacting = open(COMPACTING, O_RDONLY);
+    if (compacting < 0 || flock(compacting, LOCK_EX) < 0) {
+        perror("kv: " COMPACTING);
+        exit(1);
     }
 
-    db->items[db->size].key = key; 
-    db->items[db->size].value = strdup(value); // Duplicate the value
-    db->size++;
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        // No child to hand the work to; a later invocation will find
+        // COMPACTING unlocked and finish it.
+        close(compacting);
+        return true;
+    }
+    if (pid == 0) {
+        db_thaw_child(db);
+        // The inherited lock descriptor would keep the parent's lock alive
+        // after it exits; drop it and take our own for the swap.
+        if (!server) {
+            close(lock);
+        }
+        if (snap_write(db, SNAPSHOT_TMP)) {
+            if (!server) {
+                lock = lock_database(LOCK_EX);
+            }
+            install_snapshot();
+            unlink(COMPACTING);
+            sync_dir();
+        }
+        _exit(0);
+    }
+    close(compacting);
+    return true;
 }
 
-// Function to get a value by key 
-const char* get(Database* db, int key) {
-    for (int i = 0; i < db->size; i++) {
-        if (db->items[i].key == key) {
-            return db->items[i].value;
+
+// Load the snapshot (or the old text file) and replay the logs on top of it.
+// Only a writer may cut off a torn tail left by a crashed append.
+static Database* open_database(Snapshot** base, Wal* wal, bool writer) {
+    Database* db = init_database(16);
+    *base = snap_open(FILENAME);
+    if (*base) {
+        attach_snapshot(db, *base);
+    } else {
+        load_from_file(db, TEXTFILE); // Load data from before snapshots
+    }
+    wal_replay(COMPACTING, db, false);
+
+    wal_init(wal, LOGFILE);
+    wal->size = wal_replay(LOGFILE, db, writer);
+    return db;
+}
+
+// Change hook of the command line: every mutation goes into the log buffer,
+// to be committed once all commands have run.
+static void log_change(void* wal, int op, int key, const char* value) {
+    wal_append(wal, op, key, value);
+}
+
+// Run one command, printing its results to out and complaints to err. Values
+// are copied out of the database into scratch.
+static void run_command(Database* db, char* token, Buffer* scratch, FILE* out, FILE* err) {
+    if (token[0] == 'p' && token[1] == ',') {
+        // Put command 
+        int key; 
+        char* value = token + 2;
+        if (sscanf(token + 2, "%d, %[^\n]", &key, value) == 2) {
+            put(db, key, value);
+        } else {
+            fprintf(err, "Invalid put command\n");
         }
+    } else if (token[0] == 'g' && token[1] == ',') {
+        // Get command
+        int key = atoi(token + 2);
+        if (get(db, key, &scratch->data, &scratch->cap)) {
+            fprintf(out, "%d,%s\n", key, scratch->data);
+        } else {
+            fprintf(out, "%d not found\n", key);
+        }
+    } else if (token[0] == 'd' && token[1] == ',') {
+        // Delete command
+        int key = atoi(token + 2);
+        if (delete(db, key)) {
+            fprintf(out, "Deleted %d\n", key);
+        } else {
+            fprintf(out, "%d not found\n", key);
+        }
+    } else if (strcmp(token, "c") == 0) {
+        // Clear command
+        clear(db);
+        fprintf(out, "Cleared all key-value pairs\n");
+    } else if (token[0] == 'i' && token[1] == ',') {
+        // Import command
+        if (!load_from_file(db, token + 2)) {
+            fprintf(err, "Failed to open %s\n", token + 2);
+        }
+    } else if (token[0] == 'e' && token[1] == ',') {
+        // Export command
+        save_to_file(db, token + 2);
+    } else if (strcmp(token, "a") == 0) {
+        // All command
+        print_all(db, out);
+    } else if (token[0] == 'r' && token[1] == ',') {
+        // Range command
+        int lo, hi;
+        if (sscanf(token + 2, "%d,%d", &lo, &hi) == 2) {
+            print_range(db, lo, hi, out);
+        } else {
+            fprintf(err, "Invalid range command\n");
+        }
+    } else if (strcmp(token, "s") == 0) {
+        // Stats command
+        print_stats(db, out);
+    } else {
+        fprintf(err, "Unknown command: %s\n", token);
     }
-    return NULL;
 }
 
-// Function to delete a key-value pair 
-bool delete(Database* db, int key) {
-    for (int i = 0; i < db->size; i++) {
-        if (db->items[i].key == key) {
-            free(db->items[i].value); // Free the value
-            // Shift all elements after the found item one position to the left 
-            for (int j = i; j < db->size - 1; j++) {
-                db->items[j] = db->items[j + 1];
+// Server mode. Clients send the same commands as the command line takes, one
+// per line, and may pipeline as many as they like, except for imports and
+// exports: the server's files are not the client's to read or write. Each command's output is
+// sent back followed by an empty line; since keys and values are never empty,
+// that line marks the end of the response.
+//
+// Every connection has its own thread. Gets never block (see db.h), and
+// mutations only lock the shard of their key; they are logged from the
+// database's change hook, so the log sees them in the order they were applied.
+// All commands that arrive in one read() are answered together, after one
+// commit of the log for the whole batch.
+//
+// Lock order: sync_lock, then shards, then log_lock.
+typedef struct {
+    Database* db;
+    Wal wal;
+    int lock;                       // LOCKFILE, held for the server's lifetime
+    pthread_mutex_t log_lock;       // wal's buffer, fd and size
+    pthread_mutex_t sync_lock;      // one fdatasync at a time; synced
+    off_t synced;                   // log bytes known to be durable
+} Server;
+
+static Server server;
+
+// Change hook of the server, called under the shard lock of the change.
+static void serve_log_change(void* arg, int op, int key, const char* value) {
+    (void)arg;
+    pthread_mutex_lock(&server.log_lock);
+    wal_append(&server.wal, op, key, value);
+    pthread_mutex_unlock(&server.log_lock);
+}
+
+// Make everything this thread logged durable. Records are written under
+// log_lock, which is quick, and synced under sync_lock; a thread that finds
+// its records already covered by another thread's fdatasync skips its own, so
+// concurrent batches share one sync.
+static void serve_commit(void) {
+    pthread_mutex_lock(&server.log_lock);
+    wal_write(&server.wal);
+    off_t target = server.wal.size;
+    pthread_mutex_unlock(&server.log_lock);
+
+    pthread_mutex_lock(&server.sync_lock);
+    if (server.synced < target) {
+        pthread_mutex_lock(&server.log_lock);
+        off_t upto = server.wal.size;
+        int fd = server.wal.fd;
+        pthread_mutex_unlock(&server.log_lock);
+        // With no log open, compaction has moved it away after syncing it.
+        if (fd >= 0 && fdatasync(fd) < 0) {
+            perror("kv: " LOGFILE);
+            exit(1);
+        }
+        server.synced = upto;
+
+        if (upto >= COMPACT_MIN_BYTES) {
+            db_freeze(server.db);
+            pthread_mutex_lock(&server.log_lock);
+            // Records logged since upto, written or still buffered, must not
+            // be left unsynced in the log that is about to be moved away:
+            // their threads will find nothing to commit once it is gone.
+            wal_write(&server.wal);
+            if (server.wal.size > upto && fdatasync(server.wal.fd) < 0) {
+                perror("kv: " LOGFILE);
+                exit(1);
+            }
+            if (maybe_compact(server.db, &server.wal, server.lock, true)) {
+                server.synced = 0;
             }
-            db->size--;
-            return true;
+            pthread_mutex_unlock(&server.log_lock);
+            db_thaw(server.db);
         }
     }
-    return false;
+    pthread_mutex_unlock(&server.sync_lock);
 }
 
-void clear(Database* db) {
-    for (int i = 0; i < db->size; i++) {
-        free(db->items[i].value);
-        db->items[i].value = NULL;  // Prevent dangling pointers
+static bool write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return false;
+        buf += n;
+        len -= n;
     }
-    db->size = 0;
+    return true;
 }
-// Function to print all key-value pairs 
-void print_all(Database* db) {
-    for (int i = 0; i < db->size; i++) {
-        printf("%d,%s\n", db->items[i].key, db->items[i].value);
+
+static void* serve_connection(void* arg) {
+    int fd = (int)(intptr_t)arg;
+    size_t cap = 1 << 16, len = 0;
+    char* buf = malloc(cap);
+    Buffer scratch = { 0 };
+
+    while (buf) {
+        if (len == cap) {
+            char* bigger = realloc(buf, cap * 2); // one very long line
+            if (!bigger) break;
+            buf = bigger;
+            cap *= 2;
+        }
+        ssize_t n = read(fd, buf + len, cap - len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len += n;
+
+        char* reply = NULL;
+        size_t reply_len = 0;
+        FILE* out = open_memstream(&reply, &reply_len);
+        if (!out) break;
+
+        bool mutated = false;
+        char* line = buf;
+        char* end;
+        while ((end = memchr(line, '\n', buf + len - line)) != NULL) {
+            *end = '\0';
+            if (end > line && end[-1] == '\r') {
+                end[-1] = '\0';
+            }
+            if (is_file_command(line)) {
+                fprintf(out, "Command not allowed over a connection: %s\n\n", line);
+            } else if (*line != '\0') {
+                mutated = mutated || is_mutation(line);
+                run_command(server.db, line, &scratch, out, out);
+                fputc('\n', out);
+            }
+            line = end + 1;
+        }
+        len = buf + len - line;
+        memmove(buf, line, len);
+        fclose(out);
+
+        // Nothing is acknowledged before it is durable.
+        if (mutated) {
+            serve_commit();
+        }
+        bool ok = write_all(fd, reply, reply_len);
+        free(reply);
+        if (!ok) break;
     }
+
+    free(buf);
+    free(scratch.data);
+    close(fd);
+    return NULL;
 }
 
-void free_database(Database* db) {
-    if (db == NULL) {
-        return;
+// addr is a unix socket path, a TCP port, or host:port. A server given only
+// a port listens on the loopback interface; :port listens on all of them.
+static int open_socket(const char* addr, bool listening) {
+    const char* colon = strrchr(addr, ':');
+    bool numeric = addr[0] != '\0' && strspn(addr, "0123456789") == strlen(addr);
+    int fd;
+
+    if (numeric || colon) {
+        struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+        struct addrinfo* res;
+        char host[256] = "";
+        const char* port = addr;
+        if (colon) {
+            snprintf(host, sizeof(host), "%.*s", (int)(colon - addr), addr);
+            port = colon + 1;
+        }
+        if (listening && colon) {
+            hints.ai_flags = AI_PASSIVE;
+        }
+        int rc = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+        if (rc != 0) {
+            fprintf(stderr, "kv: %s: %s\n", addr, gai_strerror(rc));
+            exit(1);
+        }
+        // Take the first address that works, e.g. 127.0.0.1 when ::1 refuses.
+        fd = -1;
+        for (struct addrinfo* ai = res; ai && fd < 0; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0) continue;
+            int one = 1;
+            if (listening) {
+                setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            }
+            if ((listening ? bind(fd, ai->ai_addr, ai->ai_addrlen)
+                           : connect(fd, ai->ai_addr, ai->ai_addrlen)) < 0) {
+                close(fd);
+                fd = -1;
+                continue;
+            }
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        if (fd < 0) {
+            perror(addr);
+            exit(1);
+        }
+        freeaddrinfo(res);
+    } else {
+        struct sockaddr_un sun = { .sun_family = AF_UNIX };
+        if (strlen(addr) >= sizeof(sun.sun_path)) {
+            fprintf(stderr, "kv: %s: socket path too long\n", addr);
+            exit(1);
+        }
+        strcpy(sun.sun_path, addr);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listening) {
+            unlink(addr);   // left behind by an earlier server
+        }
+        if (fd < 0 || (listening ? bind(fd, (struct sockaddr*)&sun, sizeof(sun))
+                                 : connect(fd, (struct sockaddr*)&sun, sizeof(sun))) < 0) {
+            perror(addr);
+            exit(1);
+        }
     }
-    for (int i = 0; i < db->size; i++) {
-        free(db->items[i].value);
+
+    if (listening && listen(fd, SOMAXCONN) < 0) {
+        perror(addr);
+        exit(1);
     }
-    free(db->items);
-    free(db);
+    return fd;
 }
 
-// Function to save the database to a file 
-void save_to_file(Database* db) {
-    FILE* file = fopen(FILENAME, "w");
-    if (!file) {
-        fprintf(stderr, "Failed to open file for writing\n");
-        return;
+static int serve(const char* addr) {
+    // The server owns the database files for as long as it runs.
+    server.lock = lock_database(LOCK_EX);
+    Snapshot* base;
+    server.db = open_database(&base, &server.wal, true);
+    server.synced = server.wal.size;
+    set_change_hook(server.db, serve_log_change, NULL);
+    pthread_mutex_init(&server.log_lock, NULL);
+    pthread_mutex_init(&server.sync_lock, NULL);
+
+    signal(SIGPIPE, SIG_IGN);   // clients that hang up are noticed by write()
+    signal(SIGCHLD, SIG_IGN);   // compaction children reap themselves
+    int listener = open_socket(addr, true);
+
+    for (;;) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("kv: accept");
+            exit(1);
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_connection, (void*)(intptr_t)fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
     }
+}
+
+// Client mode: send the commands given as arguments, or else one per line of
+// standard input, to a server and print the responses as the command line
+// would. Commands are pipelined: they are sent as fast as the server takes
+// them while responses are read back, so a batch costs one round trip and the
+// server can commit it with one fsync.
+#define CLIENT_BATCH (1 << 16)
 
-    for (int i = 0; i < db->size; i++) {
-        fprintf(file, "%d,%s\n", db->items[i].key, db->items[i].value);
+static void append_bytes(Buffer* b, const char* data, size_t len) {
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap : CLIENT_BATCH;
+        while (cap < b->len + len) {
+            cap *= 2;
+        }
+        b->data = realloc(b->data, cap);
+        if (!b->data) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        b->cap = cap;
     }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
 
-    fclose(file);
+// Count the commands in data, i.e. the non-empty lines; *in_line carries
+// whether the last line so far has any content.
+static size_t count_commands(const char* data, size_t len, bool* in_line) {
+    size_t count = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] == '\n') {
+            count += *in_line;
+            *in_line = false;
+        } else if (data[i] != '\r') {
+            *in_line = true;
+        }
+    }
+    return count;
 }
 
-// Function to load the database from a file 
-void load_from_file(Database* db) {
-    FILE* file = fopen(FILENAME, "r");
-    if (!file) {
-        return;
+static int client(const char* addr, int argc, char* argv[]) {
+    signal(SIGPIPE, SIG_IGN);
+    int fd = open_socket(addr, false);
+
+    Buffer request = { 0 };
+    size_t sent_off = 0, commands = 0, answered = 0;
+    bool in_line = false, input_done = argc > 0, shut = false;
+    for (int i = 0; i < argc; i++) {
+        append_bytes(&request, argv[i], strlen(argv[i]));
+        append_bytes(&request, "\n", 1);
+        commands += count_commands(argv[i], strlen(argv[i]), &in_line) + in_line;
+        in_line = false;
     }
 
-    char* line = NULL;
-    size_t len = 0;
-    while (getline(&line, &len, file) != -1) {
-        int key;
-        char* value = malloc(len); // Allocate memory for the value
-        if (sscanf(line, "%d,%[^\n]", &key, value) == 2) {
-            put(db, key, value);
+    char chunk[CLIENT_BATCH];
+    bool line_empty = true;     // nothing of the current response line seen yet
+    for (;;) {
+        if (input_done && sent_off == request.len && !shut) {
+            shutdown(fd, SHUT_WR);
+            shut = true;
+        }
+        if (shut && answered == commands) {
+            break;
+        }
+
+        struct pollfd fds[2] = {
+            { .fd = fd, .events = POLLIN | (sent_off < request.len ? POLLOUT : 0) },
+            { .fd = !input_done && request.len - sent_off < CLIENT_BATCH ? STDIN_FILENO : -1,
+              .events = POLLIN },
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("kv: poll");
+            return 1;
+        }
+
+        if (fds[1].revents) {
+            ssize_t n = read(STDIN_FILENO, chunk, sizeof(chunk));
+            if (n > 0) {
+                append_bytes(&request, chunk, n);
+                commands += count_commands(chunk, n, &in_line);
+            } else if (n == 0 || errno != EINTR) {
+                if (in_line) {
+                    append_bytes(&request, "\n", 1);
+                    commands++;
+                }
+                input_done = true;
+            }
+        }
+
+        if (fds[0].revents & POLLOUT) {
+            ssize_t n = write(fd, request.data + sent_off, request.len - sent_off);
+            if (n < 0 && errno != EINTR && errno != EAGAIN) {
+                perror(addr);
+                return 1;
+            }
+            if (n > 0) {
+                sent_off += n;
+                if (sent_off == request.len) {
+                    sent_off = request.len = 0;
+                }
+            }
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = read(fd, chunk, sizeof(chunk));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                fprintf(stderr, "kv: %s: connection closed\n", addr);
+                return 1;
+            }
+            // Pass responses through, dropping the empty line after each.
+            char* p = chunk;
+            char* end = chunk + n;
+            while (p < end) {
+                char* nl = memchr(p, '\n', end - p);
+                size_t piece = (nl ? nl : end) - p;
+                if (nl && piece == 0 && line_empty) {
+                    answered++;
+                } else {
+                    fwrite(p, 1, piece + (nl != NULL), stdout);
+                    line_empty = nl != NULL;
+                }
+                p += piece + (nl != NULL);
+            }
         }
-        free(value); // Free the temporary value buffer
     }
-    free(line); // Free the line buffer
-    fclose(file);
+
+    free(request.data);
+    close(fd);
+    return 0;
 }
 
 int main(int argc, char* argv[]) {
@@ -157,54 +716,41 @@ int main(int argc, char* argv[]) {
         // No arguments provided, do nothing
         return 0;
     }
+    if (strcmp(argv[1], "--serve") == 0 || strcmp(argv[1], "--client") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "usage: kv --serve socket|port|host:port|:port\n"
+                            "       kv --client socket|port|host:port [commands...]\n");
+            return 1;
+        }
+        return argv[1][2] == 's' ? serve(argv[2]) : client(argv[2], argc - 3, argv + 3);
+    }
 
-    Database* db = init_database(10); // Capacity for 10 items
-    load_from_file(db); // Load existing data
+    bool writer = false;
+    for (int i = 1; i < argc; i++) {
+        writer = writer || is_mutation(argv[i]);
+    }
+    int lock = lock_database(writer ? LOCK_EX : LOCK_SH);
+
+    Snapshot* base;
+    Wal wal;
+    Database* db = open_database(&base, &wal, writer);
+    set_change_hook(db, log_change, &wal);
 
+    Buffer scratch = { 0 };
     for (int i = 1; i < argc; i++) {
-        char* token = argv[i];
-
-        if (token[0] == 'p' && token[1] == ',') {
-            // Put command 
-            int key; 
-            char* value = token + 2;
-            if (sscanf(token + 2, "%d, %[^\n]", &key, value) == 2) {
-                put(db, key, value);
-                save_to_file(db);
-            } else {
-                fprintf(stderr, "Invalid put command\n");
-            }
-        } else if (token[0] == 'g' && token[1] == ',') {
-            // Get command
-            int key = atoi(token + 2);
-            const char* value = get(db, key);
-            if (value) {
-                printf("%d,%s\n", key, value);
-            } else {
-                printf("%d not found\n", key);
-            }
-        } else if (token[0] == 'd' && token[1] == ',') {
-            // Delete command
-            int key = atoi(token + 2);
-            if (delete(db, key)) {
-                save_to_file(db);
-                printf("Deleted %d\n", key);
-            } else {
-                printf("%d not found\n", key);
-            }
-        } else if (strcmp(token, "c") == 0) {
-            // Clear command
-            clear(db);
-            save_to_file(db);
-            printf("Cleared all key-value pairs\n");
-        } else if (strcmp(token, "a") == 0) {
-            // All command
-            print_all(db);
-        } else {
-            fprintf(stderr, "Unknown command: %s\n", token);
-        }
+        run_command(db, argv[i], &scratch, stdout, stderr);
+    }
+    free(scratch.data);
+
+    // Group commit: the whole command line costs one write and one fsync.
+    wal_commit(&wal);
+    if (writer) {
+        maybe_compact(db, &wal, lock, false);
     }
 
+    wal_close(&wal);
     free_database(db);
+    snap_close(base);
+    close(lock);
     return 0;
 }
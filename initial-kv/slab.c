@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "slab.h"
+
+#define SMALL_LIMIT 4096      // sizes up to here find their class in a table
+
+static size_t chunk_size[SLAB_CLASSES];
+static int class_count;
+static uint8_t small_class[SMALL_LIMIT / 8 + 1];
+static pthread_once_t sizes_once = PTHREAD_ONCE_INIT;
+
+// Each class is SLAB_FACTOR times the last, rounded up to keep chunks 8-byte
+// aligned; the largest takes a whole page.
+static void init_sizes(void) {
+    size_t size = SLAB_MIN_CHUNK;
+    while (size < SLAB_PAGE_SIZE / SLAB_FACTOR && class_count < SLAB_CLASSES - 1) {
+        chunk_size[class_count++] = size;
+        size = ((size_t)(size * SLAB_FACTOR) + 7) & ~(size_t)7;
+    }
+    chunk_size[class_count++] = SLAB_PAGE_SIZE;
+
+    int i = 0;
+    for (size = 0; size <= SMALL_LIMIT; size += 8) {
+        while (chunk_size[i] < size) {
+            i++;
+        }
+        small_class[size / 8] = i;
+    }
+}
+
+size_t slab_chunk_size(int i) {
+    return chunk_size[i];
+}
+
+int slab_class_count(void) {
+    pthread_once(&sizes_once, init_sizes);
+    return class_count;
+}
+
+// The smallest class whose chunks hold size bytes, or SLAB_LARGE. Values are
+// mostly small, and a table lookup spares them a search with branches that
+// are hard to predict.
+static int class_of(size_t size) {
+    if (size <= SMALL_LIMIT) {
+        return small_class[(size + 7) / 8];
+    }
+    int lo = 0, hi = class_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (chunk_size[mid] < size) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < class_count ? lo : SLAB_LARGE;
+}
+
+static void* checked_malloc(size_t size) {
+    void* ptr = malloc(size);
+    if (!ptr) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+void slab_init(Slab* slab) {
+    slab_class_count();
+    memset(slab, 0, sizeof(Slab));
+}
+
+static Value* take_chunk(Slab* slab, int i) {
+    SlabClass* c = &slab->classes[i];
+    Value* v = c->free;
+    if (v) {
+        c->free = *(Value**)v->data;
+    } else {
+        if (c->left == 0) {
+            if (slab->page_count == slab->page_cap) {
+                slab->page_cap = slab->page_cap ? slab->page_cap * 2 : 16;
+                slab->pages = realloc(slab->pages, slab->page_cap * sizeof(char*));
+                if (!slab->pages) {
+                    fprintf(stderr, "Memory allocation failed\n");
+                    exit(1);
+                }
+            }
+            c->next = checked_malloc(SLAB_PAGE_SIZE);
+            c->left = SLAB_PAGE_SIZE / chunk_size[i];
+            slab->pages[slab->page_count++] = c->next;
+            c->pages++;
+        }
+        v = (Value*)c->next;
+        v->cap = chunk_size[i] - sizeof(Value);
+        c->next += chunk_size[i];
+        c->left--;
+    }
+    c->used++;
+    return v;
+}
+
+Value* slab_store(Slab* slab, const char* value, size_t len) {
+    size_t size = sizeof(Value) + len + 1;
+    int i = class_of(size);
+    Value* v;
+    if (i == SLAB_LARGE) {
+        v = checked_malloc(size);
+        v->cap = len + 1;
+        slab->large++;
+        slab->large_bytes += size;
+    } else {
+        v = take_chunk(slab, i);
+    }
+    memcpy(v->data, value, len + 1);
+    __atomic_store_n(&v->len, len, __ATOMIC_RELAXED);
+    slab->value_bytes += len + 1;
+    return v;
+}
+
+bool slab_replace(Slab* slab, Value* v, const char* value, size_t len) {
+    int i = class_of(sizeof(Value) + v->cap);
+    if (i == SLAB_LARGE || class_of(sizeof(Value) + len + 1) != i) {
+        return false;
+    }
+    slab->value_bytes += len;
+    slab->value_bytes -= v->len;
+    memcpy(v->data, value, len + 1);
+    __atomic_store_n(&v->len, len, __ATOMIC_RELAXED);
+    return true;
+}
+
+void slab_release(Slab* slab, Value* v, void (*free_large)(void* ptr)) {
+    slab->value_bytes -= v->len + 1;
+    int i = class_of(sizeof(Value) + v->cap);
+    if (i == SLAB_LARGE) {
+        slab->large--;
+        slab->large_bytes -= sizeof(Value) + v->cap;
+        free_large(v);
+    } else {
+        // Only data is overwritten: cap must stay valid for stale readers.
+        SlabClass* c = &slab->classes[i];
+        *(Value**)v->data = c->free;
+        c->free = v;
+        c->used--;
+    }
+}
+
+void slab_free_all(Slab* slab) {
+    for (size_t i = 0; i < slab->page_count; i++) {
+        free(slab->pages[i]);
+    }
+    free(slab->pages);
+    memset(slab, 0, sizeof(Slab));
+}
+
+void slab_stats(const Slab* slab, SlabStats* sum) {
+    for (int i = 0; i < class_count; i++) {
+        sum->pages[i] += slab->classes[i].pages;
+        sum->used[i] += slab->classes[i].used;
+    }
+    sum->large += slab->large;
+    sum->large_bytes += slab->large_bytes;
+    sum->value_bytes += slab->value_bytes;
+}
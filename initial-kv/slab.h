@@ -0,0 +1,75 @@
+#ifndef __slab_h__
+#define __slab_h__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Size-classed value storage, after memcached. Memory is taken from the
+// system in SLAB_PAGE_SIZE pages; each page belongs to one class and is cut
+// into equal chunks, the class sizes growing by SLAB_FACTOR from
+// SLAB_MIN_CHUNK up to a whole page. A freed chunk goes onto its class's free
+// list for the next value of that size, so storing a value costs no malloc()
+// and no per-allocation header beyond the Value's own. Values too big for a
+// page get a malloc()ed chunk of their own.
+//
+// Pages are never returned to the system before slab_free_all(), which is
+// what lets readers copy from a chunk without a lock: whatever a stale
+// pointer sees is still mapped memory of the same capacity, and the shard's
+// sequence count tells the reader to retry (db.c).
+#define SLAB_PAGE_SIZE (1 << 20)
+#define SLAB_MIN_CHUNK 16
+#define SLAB_FACTOR 1.25
+#define SLAB_CLASSES 64
+#define SLAB_LARGE (-1)
+
+// A stored value. cap never changes while the chunk exists, so it bounds any
+// copy even if len is being rewritten concurrently.
+typedef struct {
+    uint32_t cap;       // bytes available in data
+    uint32_t len;       // bytes of the value, excluding its terminating NUL
+    char data[];
+} Value;
+
+typedef struct {
+    Value* free;        // chunks given back, linked through their data
+    char* next;         // uncut rest of the newest page
+    size_t left;        // chunks left in it
+    size_t pages;
+    size_t used;        // chunks holding values
+} SlabClass;
+
+typedef struct {
+    SlabClass classes[SLAB_CLASSES];
+    char** pages;       // every page, for slab_free_all()
+    size_t page_count;
+    size_t page_cap;
+    size_t large;       // values stored outside the pages, and their bytes
+    size_t large_bytes;
+    size_t value_bytes; // bytes of stored values, NULs included
+} Slab;
+
+// Per-class and total usage, summed over any number of slabs.
+typedef struct {
+    size_t pages[SLAB_CLASSES];
+    size_t used[SLAB_CLASSES];
+    size_t large;
+    size_t large_bytes;
+    size_t value_bytes;
+} SlabStats;
+
+// Bytes per chunk of class i, and the number of classes.
+size_t slab_chunk_size(int i);
+int slab_class_count(void);
+
+void slab_init(Slab* slab);
+// Store value (len bytes plus a NUL) in a fresh chunk.
+Value* slab_store(Slab* slab, const char* value, size_t len);
+// Overwrite v with value if it needs the same class; false if it does not.
+bool slab_replace(Slab* slab, Value* v, const char* value, size_t len);
+// Give v back. Chunks are reused at once, large values through free_large.
+void slab_release(Slab* slab, Value* v, void (*free_large)(void* ptr));
+void slab_free_all(Slab* slab);
+void slab_stats(const Slab* slab, SlabStats* sum);
+
+#endif // __slab_h__
@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snap.h"
+
+static void corrupt(const char* path) {
+    fprintf(stderr, "kv: %s: corrupt snapshot\n", path);
+    exit(1);
+}
+
+Snapshot* snap_open(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return NULL;
+        }
+        perror(path);
+        exit(1);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror(path);
+        exit(1);
+    }
+    if ((size_t)st.st_size < sizeof(SnapHeader)) {
+        corrupt(path);
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(path);
+        exit(1);
+    }
+
+    const SnapHeader* header = map;
+    size_t size = st.st_size;
+    size_t index_end = sizeof(SnapHeader) + header->count * sizeof(SnapEntry);
+    if (memcmp(header->magic, SNAP_MAGIC, 4) != 0 || header->version != SNAP_VERSION ||
+        header->count > size / sizeof(SnapEntry) || header->heap_offset < index_end ||
+        header->heap_offset > size || header->heap_size != size - header->heap_offset) {
+        corrupt(path);
+    }
+
+    Snapshot* snap = malloc(sizeof(Snapshot));
+    if (!snap) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    snap->map = map;
+    snap->map_size = size;
+    snap->index = (const SnapEntry*)(header + 1);
+    snap->count = header->count;
+    snap->heap = (const char*)map + header->heap_offset;
+    snap->heap_size = header->heap_size;
+    return snap;
+}
+
+void snap_close(Snapshot* snap) {
+    if (snap == NULL) {
+        return;
+    }
+    munmap(snap->map, snap->map_size);
+    free(snap);
+}
+
+size_t snap_lower_bound(const Snapshot* snap, int key) {
+    size_t lo = 0, hi = snap->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (snap->index[mid].key < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+const SnapEntry* snap_find(const Snapshot* snap, int key) {
+    size_t i = snap_lower_bound(snap, key);
+    return i < snap->count && snap->index[i].key == key ? &snap->index[i] : NULL;
+}
+
+// Values are checked when they are used rather than when the file is opened,
+// which would mean reading the whole index.
+const char* snap_value(const Snapshot* snap, const SnapEntry* entry) {
+    if (entry->value >= snap->heap_size || entry->len >= snap->heap_size - entry->value ||
+        snap->heap[entry->value + entry->len] != '\0') {
+        fprintf(stderr, "kv: corrupt snapshot value for key %d\n", entry->key);
+        exit(1);
+    }
+    return snap->heap + entry->value;
+}
+
+typedef struct {
+    SnapEntry* entries;
+    const char** values;
+    size_t count;
+    size_t cap;
+} Collector;
+
+// for_each hands pairs over in listing order, which becomes the stamp.
+static void collect(int key, const char* value, void* arg) {
+    Collector* c = arg;
+    if (c->count == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 1024;
+        c->entries = realloc(c->entries, c->cap * sizeof(SnapEntry));
+        c->values = realloc(c->values, c->cap * sizeof(char*));
+        if (!c->entries || !c->values) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+    }
+    c->entries[c->count] = (SnapEntry){ .key = key, .len = strlen(value), .order = c->count };
+    c->values[c->count] = value;
+    c->count++;
+}
+
+static int compare_key(const void* a, const void* b) {
+    int x = ((const SnapEntry*)a)->key;
+    int y = ((const SnapEntry*)b)->key;
+    return (x > y) - (x < y);
+}
+
+bool snap_write(Database* db, const char* path) {
+    Collector c = { 0 };
+    for_each(db, collect, &c);
+
+    // Sort by key, carrying the stamp along so the value can be found again.
+    qsort(c.entries, c.count, sizeof(SnapEntry), compare_key);
+    uint64_t heap_size = 0;
+    for (size_t i = 0; i < c.count; i++) {
+        c.entries[i].value = heap_size;
+        heap_size += c.entries[i].len + 1;
+    }
+
+    SnapHeader header = {
+        .magic = SNAP_MAGIC,
+        .version = SNAP_VERSION,
+        .count = c.count,
+        .heap_offset = sizeof(SnapHeader) + c.count * sizeof(SnapEntry),
+        .heap_size = heap_size,
+    };
+
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Failed to open file for writing\n");
+        free(c.entries);
+        free(c.values);
+        return false;
+    }
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(c.entries, sizeof(SnapEntry), c.count, file);
+    for (size_t i = 0; i < c.count; i++) {
+        fwrite(c.values[c.entries[i].order], 1, c.entries[i].len + 1, file);
+    }
+
+    bool ok = !ferror(file) && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+    if (!ok) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        unlink(path);
+    }
+    free(c.entries);
+    free(c.values);
+    return ok;
+}
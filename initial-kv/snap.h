@@ -0,0 +1,56 @@
+#ifndef __snap_h__
+#define __snap_h__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "db.h"
+
+// Binary snapshot of a database. The file is a header, an index of entries
+// sorted by key, and a heap of NUL-terminated values:
+//
+//     SnapHeader | SnapEntry[count] | value heap
+//
+// It is mapped read-only, so opening it is O(1) and a lookup touches only the
+// index pages of its binary search and the page holding its value.
+#define SNAP_MAGIC "KVSN"
+#define SNAP_VERSION 1
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t count;         // number of entries in the index
+    uint64_t heap_offset;   // file offset of the value heap
+    uint64_t heap_size;
+} SnapHeader;
+
+typedef struct {
+    int32_t key;
+    uint32_t len;           // value length, not counting the NUL
+    uint64_t value;         // offset of the value in the heap
+    uint64_t order;         // insertion stamp, 0 .. count-1
+} SnapEntry;
+
+struct Snapshot {
+    void* map;
+    size_t map_size;
+    const SnapEntry* index;
+    size_t count;
+    const char* heap;
+    size_t heap_size;
+};
+
+// Returns NULL if there is no snapshot at path; exits if it is corrupt.
+Snapshot* snap_open(const char* path);
+void snap_close(Snapshot* snap);
+
+// Returns the entry for key, or NULL.
+const SnapEntry* snap_find(const Snapshot* snap, int key);
+// Position of the first entry whose key is at least key (count if none).
+size_t snap_lower_bound(const Snapshot* snap, int key);
+const char* snap_value(const Snapshot* snap, const SnapEntry* entry);
+
+// Write db to path as a snapshot and fsync it. Listing order is preserved.
+bool snap_write(Database* db, const char* path);
+
+#endif // __snap_h__
@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "wal.h"
+
+#define HEADER_SIZE 8           // crc + length
+#define MIN_PAYLOAD 6           // op + key + the value's terminating NUL
+
+static uint32_t crc_table[256];
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32(const unsigned char* p, size_t n) {
+    if (crc_table[1] == 0) {
+        crc_init();
+    }
+    uint32_t c = 0xFFFFFFFFu;
+    while (n--) {
+        c = crc_table[(c ^ *p++) & 0xFF] ^ (c >> 8);
+    }
+    return c ^ 0xFFFFFFFFu;
+}
+
+static void die(const char* what) {
+    fprintf(stderr, "kv: %s: %s\n", what, strerror(errno));
+    exit(1);
+}
+
+void sync_dir(void) {
+    int dir = open(".", O_RDONLY);
+    if (dir >= 0) {
+        fsync(dir);
+        close(dir);
+    }
+}
+
+void wal_init(Wal* wal, const char* path) {
+    wal->fd = -1;
+    wal->path = path;
+    wal->buf = NULL;
+    wal->len = 0;
+    wal->cap = 0;
+    wal->size = 0;
+}
+
+void wal_close(Wal* wal) {
+    if (wal->len > 0) {
+        // Dropping them would lose changes that may yet be acknowledged.
+        fprintf(stderr, "kv: %s: closed with %zu bytes of records not written\n", wal->path, wal->len);
+        exit(1);
+    }
+    if (wal->fd >= 0) {
+        close(wal->fd);
+    }
+    free(wal->buf);
+    wal_init(wal, wal->path);
+}
+
+off_t wal_replay(const char* path, Database* db, bool truncate) {
+    int fd = open(path, truncate ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        die(path);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        die(path);
+    }
+    unsigned char* data = malloc(st.st_size ? st.st_size : 1);
+    if (!data) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    size_t have = 0;
+    while (have < (size_t)st.st_size) {
+        ssize_t n = read(fd, data + have, st.st_size - have);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) die(path);
+        if (n == 0) break;
+        have += n;
+    }
+
+    size_t pos = 0;
+    while (have - pos >= HEADER_SIZE) {
+        uint32_t crc, len;
+        memcpy(&crc, data + pos, 4);
+        memcpy(&len, data + pos + 4, 4);
+        if (len < MIN_PAYLOAD || len > have - pos - HEADER_SIZE) {
+            break;
+        }
+        unsigned char* payload = data + pos + HEADER_SIZE;
+        if (crc32(payload, len) != crc || payload[len - 1] != '\0') {
+            break;
+        }
+
+        int key;
+        memcpy(&key, payload + 1, 4);
+        switch (payload[0]) {
+        case DB_PUT:
+            put(db, key, (const char*)payload + 5);
+            break;
+        case DB_DELETE:
+            delete(db, key);
+            break;
+        case DB_CLEAR:
+            clear(db);
+            break;
+        }
+        pos += HEADER_SIZE + len;
+    }
+
+    if (truncate && pos < (size_t)st.st_size) {
+        if (ftruncate(fd, pos) < 0 || fdatasync(fd) < 0) {
+            die(path);
+        }
+    }
+    free(data);
+    close(fd);
+    return pos;
+}
+
+void wal_append(Wal* wal, int op, int key, const char* value) {
+    if (value == NULL) {
+        value = "";
+    }
+    size_t value_len = strlen(value) + 1;
+    size_t need = HEADER_SIZE + 5 + value_len;
+    if (wal->len + need > wal->cap) {
+        size_t cap = wal->cap ? wal->cap : 4096;
+        while (cap < wal->len + need) {
+            cap *= 2;
+        }
+        char* buf = realloc(wal->buf, cap);
+        if (!buf) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        wal->buf = buf;
+        wal->cap = cap;
+    }
+
+    unsigned char* rec = (unsigned char*)wal->buf + wal->len;
+    unsigned char* payload = rec + HEADER_SIZE;
+    uint32_t len = 5 + value_len;
+    payload[0] = op;
+    memcpy(payload + 1, &key, 4);
+    memcpy(payload + 5, value, value_len);
+    uint32_t crc = crc32(payload, len);
+    memcpy(rec, &crc, 4);
+    memcpy(rec + 4, &len, 4);
+    wal->len += need;
+}
+
+// Open the log for appending. A newly created log is only durable once the
+// directory entry is, so the directory is synced as well.
+static void open_log(Wal* wal) {
+    wal->fd = open(wal->path, O_WRONLY | O_APPEND);
+    if (wal->fd >= 0) {
+        return;
+    }
+    if (errno != ENOENT) {
+        die(wal->path);
+    }
+    wal->fd = open(wal->path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (wal->fd < 0) {
+        die(wal->path);
+    }
+    sync_dir();
+}
+
+void wal_write(Wal* wal) {
+    if (wal->len == 0) {
+        return;
+    }
+    if (wal->fd < 0) {
+        open_log(wal);
+    }
+
+    size_t done = 0;
+    while (done < wal->len) {
+        ssize_t n = write(wal->fd, wal->buf + done, wal->len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) die(wal->path);
+        done += n;
+    }
+    wal->size += wal->len;
+    wal->len = 0;
+}
+
+void wal_commit(Wal* wal) {
+    if (wal->len == 0) {
+        return;
+    }
+    wal_write(wal);
+    if (fdatasync(wal->fd) < 0) {
+        die(wal->path);
+    }
+}
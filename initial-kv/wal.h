@@ -0,0 +1,48 @@
+#ifndef __wal_h__
+#define __wal_h__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "db.h"
+
+// Write-ahead log. Every mutation is appended as one record
+//
+//     u32 crc32(payload) | u32 payload length | u8 op | i32 key | value bytes
+//
+// where op is a DB_ change code, and records are only buffered in memory
+// until wal_commit(), which writes them with a single write() and makes them
+// durable with a single fdatasync() (group commit).
+
+typedef struct {
+    int fd;             // -1 until the first commit opens the log
+    const char* path;
+    char* buf;          // records appended since the last commit
+    size_t len;
+    size_t cap;
+    off_t size;         // bytes of valid records in the log file
+} Wal;
+
+void wal_init(Wal* wal, const char* path);
+// The buffer must be empty: records are written before a log is closed.
+void wal_close(Wal* wal);
+
+// Apply the records in the log at path to db. A torn or corrupt tail (an
+// interrupted append) ends the replay; if truncate is set it is cut off so
+// that later appends follow the last good record. Returns the number of bytes
+// of valid records, or 0 if there is no log.
+off_t wal_replay(const char* path, Database* db, bool truncate);
+
+// Buffer a record for a change; value is NULL unless op is DB_PUT.
+void wal_append(Wal* wal, int op, int key, const char* value);
+
+// Append the buffered records to the log and fdatasync it.
+void wal_commit(Wal* wal);
+// Only append the buffered records; the caller syncs wal->fd.
+void wal_write(Wal* wal);
+
+// fsync the current directory, making creates, renames and unlinks in it
+// durable.
+void sync_dir(void);
+
+#endif // __wal_h__
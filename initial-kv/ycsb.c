@@ -0,0 +1,163 @@
+// YCSB-style multithreaded benchmark for the in-memory store. Loads R
+// records, then runs O operations split over T threads with keys drawn from
+// a Zipfian distribution (theta 0.99, as in YCSB) and reports throughput.
+//
+//   workload a: 50% reads, 50% updates
+//   workload b: 95% reads,  5% updates
+//   workload c: 100% reads
+//
+//   prompt> make ycsb && ./ycsb [workload] [threads] [records] [ops]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include "db.h"
+
+#define THETA 0.99
+
+typedef struct {
+    long n;
+    double alpha, zetan, eta;
+} Zipf;
+
+typedef struct {
+    Database* db;
+    const Zipf* zipf;
+    long ops;
+    int read_percent;
+    uint64_t seed;
+    long reads;
+    long hits;
+} Worker;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64*: cheap, and private to each thread.
+static uint64_t next_random(uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ull;
+}
+
+static double uniform(uint64_t* state) {
+    return (next_random(state) >> 11) * (1.0 / (1ull << 53));
+}
+
+// Gray et al., "Quickly generating billion-record synthetic databases".
+static void zipf_init(Zipf* z, long n) {
+    double zeta2 = 1 + pow(0.5, THETA);
+    z->n = n;
+    z->zetan = 0;
+    for (long i = 1; i <= n; i++) {
+        z->zetan += 1 / pow(i, THETA);
+    }
+    z->alpha = 1 / (1 - THETA);
+    z->eta = (1 - pow(2.0 / n, 1 - THETA)) / (1 - zeta2 / z->zetan);
+}
+
+static long zipf_next(const Zipf* z, uint64_t* state) {
+    double u = uniform(state);
+    double uz = u * z->zetan;
+    if (uz < 1) {
+        return 0;
+    }
+    if (uz < 1 + pow(0.5, THETA)) {
+        return 1;
+    }
+    long i = (long)(z->n * pow(z->eta * u - z->eta + 1, z->alpha));
+    return i < z->n ? i : z->n - 1;
+}
+
+// Scatter ranks over the int range so the hot keys do not share a shard.
+static int key_of(long i) {
+    return (int)((unsigned)i * 2654435761u);
+}
+
+static void* run(void* arg) {
+    Worker* w = arg;
+    char* buf = NULL;
+    size_t cap = 0;
+    char value[32];
+
+    for (long i = 0; i < w->ops; i++) {
+        int key = key_of(zipf_next(w->zipf, &w->seed));
+        if ((long)(next_random(&w->seed) % 100) < w->read_percent) {
+            w->reads++;
+            w->hits += get(w->db, key, &buf, &cap);
+        } else {
+            snprintf(value, sizeof(value), "update%ld", i);
+            put(w->db, key, value);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    char workload = argc > 1 ? argv[1][0] : 'b';
+    int threads = argc > 2 ? atoi(argv[2]) : 4;
+    long records = argc > 3 ? atol(argv[3]) : 1000000;
+    long ops = argc > 4 ? atol(argv[4]) : 10000000;
+    int read_percent = workload == 'a' ? 50 : workload == 'b' ? 95 : workload == 'c' ? 100 : -1;
+
+    if (read_percent < 0 || threads <= 0 || records <= 0 || ops <= 0) {
+        fprintf(stderr, "usage: ycsb [a|b|c] [threads] [records] [ops]\n");
+        return 1;
+    }
+
+    Database* db = init_database(16);
+    char value[32];
+    for (long i = 0; i < records; i++) {
+        snprintf(value, sizeof(value), "value%ld", i);
+        put(db, key_of(i), value);
+    }
+
+    Zipf zipf;
+    zipf_init(&zipf, records);
+
+    pthread_t* tids = malloc(threads * sizeof(pthread_t));
+    Worker* workers = malloc(threads * sizeof(Worker));
+    if (!tids || !workers) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    double start = now();
+    for (int t = 0; t < threads; t++) {
+        workers[t] = (Worker){
+            .db = db,
+            .zipf = &zipf,
+            .ops = ops / threads + (t < ops % threads),
+            .read_percent = read_percent,
+            .seed = 0x9E3779B97F4A7C15ull * (t + 1),
+        };
+        pthread_create(&tids[t], NULL, run, &workers[t]);
+    }
+    long reads = 0, hits = 0;
+    for (int t = 0; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+        reads += workers[t].reads;
+        hits += workers[t].hits;
+    }
+    double seconds = now() - start;
+
+    printf("workload %c %2d threads %10ld ops %8.3f s %8.2f Mops/s\n",
+           workload, threads, ops, seconds, ops / seconds / 1e6);
+
+    // Every key is loaded up front and never deleted, so every read hits.
+    if (hits != reads) {
+        fprintf(stderr, "ycsb: unexpected miss\n");
+        return 1;
+    }
+
+    free(tids);
+    free(workers);
+    free_database(db);
+    return 0;
+}
@@ -1,9 +1,21 @@
-#include <stdio.h>    // getline, fileno, fopen, fclose, fprintf
-#include <stdlib.h>   // exit, malloc
-#include <string.h>   // strdup
+#define _GNU_SOURCE
+#include <stdio.h>    // fread, fileno, fopen, fclose, fprintf
+#include <stdlib.h>   // exit, malloc, mkstemp
+#include <string.h>   // memcpy, memrchr
+#include <errno.h>
+#include <unistd.h>   // write, pread, pwrite, unlink
+#include <sys/mman.h> // mmap, munmap
 #include <sys/stat.h> // fstat
 #include <sys/types.h>
 
+#define OUT_BUFFER_SIZE (1 << 20) // lines are batched into 1 MB writes
+#ifndef SEGMENT_SIZE
+#define SEGMENT_SIZE (64 << 20)   // streamed input is stored in 64 MB arenas
+#endif
+#ifndef MEMORY_LIMIT
+#define MEMORY_LIMIT (256 << 20)  // arena bytes kept in memory before spilling
+#endif
+
 // Macro for error handling: print message and exit with failure status
 #define handle_error(msg)                                                      \
   do {                                                                         \
@@ -11,11 +23,228 @@
     exit(EXIT_FAILURE);                                                        \
   } while (0)
 
-// Linked list structure for storing lines of text
-typedef struct linkedList {
-  char *line;            // Pointer to the text of the line
-  struct linkedList *next; // Pointer to the next node in the list
-} LinkedList;
+// A contiguous run of whole input lines read from a stream. Only the last
+// segment may end without a newline. Segments are spilled to a temporary
+// file, oldest first, once too many are held in memory.
+typedef struct {
+  char *data;            // NULL once the segment has been spilled
+  size_t len;
+  off_t spill_offset;    // Where the segment lives in the spill file
+} Segment;
+
+typedef struct {
+  Segment *segments;
+  size_t count;
+  size_t capacity;
+  size_t in_memory;      // Bytes of segment data currently in memory
+  size_t first_resident; // Segments before this one have been spilled
+  int spill_fd;          // Unlinked temporary file, or -1 until needed
+  off_t spill_size;
+} SegmentList;
+
+// Output batching: lines are copied into one large buffer and written with a
+// single write() when it fills up; lines longer than the buffer bypass it.
+typedef struct {
+  int fd;
+  char *data;
+  size_t len;
+} OutBuffer;
+
+static void write_all(int fd, const char *p, size_t n) {
+  while (n > 0) {
+    ssize_t w = write(fd, p, n);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      handle_error("reverse: write failed\n");
+    }
+    p += w;
+    n -= w;
+  }
+}
+
+static void out_flush(OutBuffer *ob) {
+  write_all(ob->fd, ob->data, ob->len);
+  ob->len = 0;
+}
+
+static void out_append(OutBuffer *ob, const char *p, size_t n) {
+  if (ob->len + n > OUT_BUFFER_SIZE)
+    out_flush(ob);
+  if (n >= OUT_BUFFER_SIZE) {
+    write_all(ob->fd, p, n);
+    return;
+  }
+  memcpy(ob->data + ob->len, p, n);
+  ob->len += n;
+}
+
+// Emit the lines of [data, data + size) last to first. Each line keeps its
+// own terminator, so an unterminated last line comes out first, joined to
+// the line that preceded it -- exactly as the getline() path behaves.
+static void reverse_lines(OutBuffer *ob, const char *data, size_t size) {
+  size_t end = size;
+  while (end > 0) {
+    // The newline ending the previous line is the last one before the
+    // current line's own final byte.
+    const char *nl = memrchr(data, '\n', end - 1);
+    size_t start = nl ? (size_t)(nl - data) + 1 : 0;
+    out_append(ob, data + start, end - start);
+    end = start;
+  }
+}
+
+// Reverse a regular file in place in the page cache: map it and scan
+// backwards for newlines, so memory use does not depend on the file size.
+static int reverse_mapped(FILE *in, FILE *out) {
+  struct stat sb;
+  if (fstat(fileno(in), &sb) == -1 || !S_ISREG(sb.st_mode) || sb.st_size == 0)
+    return 0;
+
+  char *data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+  if (data == MAP_FAILED)
+    return 0;
+
+  OutBuffer ob = {fileno(out), malloc(OUT_BUFFER_SIZE), 0};
+  if (ob.data == NULL)
+    handle_error("reverse: malloc failed\n");
+
+  fflush(out);
+  reverse_lines(&ob, data, sb.st_size);
+  out_flush(&ob);
+
+  free(ob.data);
+  munmap(data, sb.st_size);
+  return 1;
+}
+
+static int open_spill_file(void) {
+  const char *dir = getenv("TMPDIR");
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/reverse-XXXXXX", dir ? dir : "/tmp");
+  int fd = mkstemp(path);
+  if (fd == -1)
+    handle_error("reverse: cannot create temporary file\n");
+  unlink(path);
+  return fd;
+}
+
+// Write the oldest in-memory segments to the spill file until the ones left
+// fit in MEMORY_LIMIT. They are the last to be printed, so they are also the
+// ones we can afford to read back later.
+static void spill_segments(SegmentList *list) {
+  while (list->in_memory > MEMORY_LIMIT && list->first_resident < list->count) {
+    Segment *seg = &list->segments[list->first_resident++];
+    if (list->spill_fd == -1)
+      list->spill_fd = open_spill_file();
+    for (size_t done = 0; done < seg->len;) {
+      ssize_t w = pwrite(list->spill_fd, seg->data + done, seg->len - done,
+                         list->spill_size + done);
+      if (w < 0) {
+        if (errno == EINTR)
+          continue;
+        handle_error("reverse: cannot write temporary file\n");
+      }
+      done += w;
+    }
+    seg->spill_offset = list->spill_size;
+    list->spill_size += seg->len;
+    list->in_memory -= seg->len;
+    free(seg->data);
+    seg->data = NULL;
+  }
+}
+
+static void add_segment(SegmentList *list, char *data, size_t len) {
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 16;
+    list->segments = realloc(list->segments, sizeof(Segment) * list->capacity);
+    if (list->segments == NULL)
+      handle_error("reverse: malloc failed\n");
+  }
+  list->segments[list->count++] = (Segment){data, len, 0};
+  list->in_memory += len;
+  spill_segments(list);
+}
+
+// Read a stream into large arenas instead of one allocation per line. A full
+// arena is cut after its last newline and the partial line is carried into
+// the next arena; an arena without any newline grows instead.
+static void read_segments(FILE *in, SegmentList *list) {
+  size_t capacity = SEGMENT_SIZE, len = 0;
+  char *data = malloc(capacity);
+  if (data == NULL)
+    handle_error("reverse: malloc failed\n");
+
+  while (1) {
+    size_t n = fread(data + len, 1, capacity - len, in);
+    len += n;
+    if (len < capacity) {
+      if (ferror(in))
+        handle_error("reverse: read error\n");
+      break; // end of input
+    }
+
+    char *nl = memrchr(data, '\n', len);
+    if (nl == NULL) {
+      capacity *= 2;
+      if ((data = realloc(data, capacity)) == NULL)
+        handle_error("reverse: malloc failed\n");
+      continue;
+    }
+
+    size_t keep = nl - data + 1;
+    size_t next_capacity = SEGMENT_SIZE > len - keep ? SEGMENT_SIZE : 2 * (len - keep);
+    char *next = malloc(next_capacity);
+    if (next == NULL)
+      handle_error("reverse: malloc failed\n");
+    memcpy(next, data + keep, len - keep);
+    add_segment(list, data, keep);
+    data = next;
+    len -= keep;
+    capacity = next_capacity;
+  }
+
+  if (len > 0)
+    add_segment(list, data, len);
+  else
+    free(data);
+}
+
+// Print the segments last to first, reading spilled ones back one at a time.
+static void reverse_segments(OutBuffer *ob, SegmentList *list) {
+  char *buffer = NULL;
+  size_t buffer_size = 0;
+
+  for (size_t i = list->count; i-- > 0;) {
+    Segment *seg = &list->segments[i];
+    if (seg->data != NULL) {
+      reverse_lines(ob, seg->data, seg->len);
+      free(seg->data);
+      continue;
+    }
+
+    if (seg->len > buffer_size) {
+      free(buffer);
+      buffer_size = seg->len;
+      if ((buffer = malloc(buffer_size)) == NULL)
+        handle_error("reverse: malloc failed\n");
+    }
+    for (size_t done = 0; done < seg->len;) {
+      ssize_t r = pread(list->spill_fd, buffer + done, seg->len - done,
+                        seg->spill_offset + done);
+      if (r <= 0) {
+        if (r < 0 && errno == EINTR)
+          continue;
+        handle_error("reverse: cannot read temporary file\n");
+      }
+      done += r;
+    }
+    reverse_lines(ob, buffer, seg->len);
+  }
+
+  free(buffer);
+}
 
 int main(int argc, char *argv[]) {
   FILE *in = NULL, *out = NULL;
@@ -47,37 +276,29 @@ int main(int argc, char *argv[]) {
   } else if (argc > 3)
     handle_error("usage: reverse <input> <output>\n");
 
-  LinkedList *head = NULL; // Initialize the head of the linked list to NULL
-  char *line = NULL;
-  size_t len = 0;
-
-  // Read lines from the input file and store them in the linked list in reverse order
-  while (getline(&line, &len, in) != -1) {
-    LinkedList *node = malloc(sizeof(LinkedList));
-    if (node == NULL) {
-      free(line);
-      handle_error("reverse: malloc failed\n");
-    }
-    if ((node->line = strdup(line)) == NULL) {
-      free(line);
-      handle_error("reverse: strdup failed\n");
-    }
-    node->next = head;
-    head = node;
+  if (reverse_mapped(in, out)) {
+    fclose(in);
+    fclose(out);
+    return 0;
   }
 
-  // Iterate through the linked list and write the lines to the output file
-  while (head != NULL) {
-    LinkedList *temp = head;
-    fprintf(out, "%s", head->line);
-    head = head->next;
-    // Free memory allocated for each node
-    free(temp->line);
-    free(temp);
-  }
+  // Input that cannot be mapped (pipes, terminals): buffer it in arenas,
+  // spilling to disk when it is too large to keep in memory.
+  SegmentList list = {NULL, 0, 0, 0, 0, -1, 0};
+  OutBuffer ob = {fileno(out), malloc(OUT_BUFFER_SIZE), 0};
+  if (ob.data == NULL)
+    handle_error("reverse: malloc failed\n");
+
+  read_segments(in, &list);
+  fflush(out);
+  reverse_segments(&ob, &list);
+  out_flush(&ob);
 
   // Cleanup: free memory and close files
-  free(line);
+  if (list.spill_fd != -1)
+    close(list.spill_fd);
+  free(list.segments);
+  free(ob.data);
   fclose(in);
   fclose(out);
   return 0;
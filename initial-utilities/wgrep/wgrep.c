@@ -1,16 +1,291 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
+#define PARALLEL_MIN (8 << 20)   // files smaller than this are searched on one thread
+#define MAX_THREADS 64
+#define IOV_BATCH 1024           // iovecs handed to a single writev()
+#define DENSE_STATES 512         // automaton states with a full 256-entry transition row
 
-void search_file(FILE *file, const char *search_term) {
+// Aho-Corasick automaton over the patterns given with -f. States are numbered
+// in breadth-first order, so the shallow states that nearly every byte passes
+// through come first: they get a complete transition row (failure transitions
+// folded in). Deeper, colder states keep only their trie edges, sorted by
+// label, plus a failure link that is followed until a dense state is reached.
+typedef struct {
+    int num_states;
+    int num_dense;
+    int *dense;              // num_dense rows of 256 next states
+    int *edge_start;         // edges of state s: edge_start[s] .. edge_start[s + 1]
+    unsigned char *edge_label;
+    int *edge_target;
+    int *fail;
+    int *output;             // pattern recognized on entering a state, or -1
+    char **patterns;
+    int num_patterns;
+} Automaton;
+
+// What to search for: a single term, or the automaton built from -f.
+typedef struct {
+    const char *term;
+    size_t term_len;
+    const Automaton *ac;
+    int show_pattern;        // -p: prefix each line with the pattern that matched
+} Query;
+
+// A run of matching lines [start, end) in the mapped file, newlines included.
+// Adjacent matching lines are merged into one range unless the pattern of
+// each line is reported.
+typedef struct {
+    size_t start;
+    size_t end;
+    int pattern;             // pattern to print before the line, or -1
+} Match;
+
+typedef struct {
+    Match *items;
+    size_t count;
+    size_t capacity;
+} MatchList;
+
+// One thread's share of a mapped file: whole lines from begin to end.
+typedef struct {
+    const char *data;
+    size_t begin;
+    size_t end;
+    const Query *query;
+    MatchList matches;
+} SearchTask;
+
+void *xmalloc(size_t size) {
+    void *p = malloc(size);
+    if (p == NULL) {
+        fprintf(stderr, "wgrep: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static inline int ac_step(const Automaton *ac, int state, unsigned char c) {
+    while (state >= ac->num_dense) {
+        int lo = ac->edge_start[state], hi = ac->edge_start[state + 1];
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (ac->edge_label[mid] < c) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo < ac->edge_start[state + 1] && ac->edge_label[lo] == c) {
+            return ac->edge_target[lo];
+        }
+        state = ac->fail[state];
+    }
+    return ac->dense[state * 256 + c];
+}
+
+// Scan [p, p + len) for any pattern. Returns the position just past the first
+// occurrence and stores which pattern it was, or returns NULL.
+const char *ac_find(const Automaton *ac, const char *p, size_t len, int *pattern) {
+    const unsigned char *s = (const unsigned char *)p;
+    int state = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        state = ac_step(ac, state, s[i]);
+        if (ac->output[state] >= 0) {
+            *pattern = ac->output[state];
+            return p + i + 1;
+        }
+    }
+    return NULL;
+}
+
+// Build the automaton for one pattern per line of file. Empty lines are
+// skipped; no pattern ever contains a newline, so scanning a newline always
+// returns to the root and matches cannot span lines.
+Automaton *ac_build(FILE *file) {
+    Automaton *ac = xmalloc(sizeof(Automaton));
+    int capacity = 1024, num_nodes = 1, pattern_capacity = 64;
+    // Trie under construction: children as sibling lists.
+    int *child = xmalloc(sizeof(int) * capacity);
+    int *sibling = xmalloc(sizeof(int) * capacity);
+    unsigned char *label = xmalloc(capacity);
+    int *terminal = xmalloc(sizeof(int) * capacity);
+    char *line = NULL;
+    size_t len = 0;
+    ssize_t read;
+
+    child[0] = sibling[0] = terminal[0] = -1;
+    ac->patterns = xmalloc(sizeof(char *) * pattern_capacity);
+    ac->num_patterns = 0;
+
+    while ((read = getline(&line, &len, file)) != -1) {
+        if (read > 0 && line[read - 1] == '\n') {
+            line[--read] = '\0';
+        }
+        if (read == 0) {
+            continue;
+        }
+
+        int node = 0;
+        for (ssize_t i = 0; i < read; i++) {
+            unsigned char c = line[i];
+            int next = child[node];
+            while (next != -1 && label[next] != c) {
+                next = sibling[next];
+            }
+            if (next == -1) {
+                if (num_nodes == capacity) {
+                    capacity *= 2;
+                    child = realloc(child, sizeof(int) * capacity);
+                    sibling = realloc(sibling, sizeof(int) * capacity);
+                    label = realloc(label, capacity);
+                    terminal = realloc(terminal, sizeof(int) * capacity);
+                    if (!child || !sibling || !label || !terminal) {
+                        fprintf(stderr, "wgrep: out of memory\n");
+                        exit(1);
+                    }
+                }
+                next = num_nodes++;
+                child[next] = terminal[next] = -1;
+                label[next] = c;
+                sibling[next] = child[node];
+                child[node] = next;
+            }
+            node = next;
+        }
+
+        if (terminal[node] == -1) {
+            if (ac->num_patterns == pattern_capacity) {
+                pattern_capacity *= 2;
+                ac->patterns = realloc(ac->patterns, sizeof(char *) * pattern_capacity);
+                if (ac->patterns == NULL) {
+                    fprintf(stderr, "wgrep: out of memory\n");
+                    exit(1);
+                }
+            }
+            terminal[node] = ac->num_patterns;
+            ac->patterns[ac->num_patterns++] = strdup(line);
+        }
+    }
+    free(line);
+
+    // Number the states breadth first; order[] lists trie nodes by new number.
+    int *order = xmalloc(sizeof(int) * num_nodes);
+    int *number = xmalloc(sizeof(int) * num_nodes);
+    int head = 0, tail = 0;
+    order[tail++] = 0;
+    while (head < tail) {
+        int node = order[head++];
+        number[node] = head - 1;
+        for (int c = child[node]; c != -1; c = sibling[c]) {
+            order[tail++] = c;
+        }
+    }
+
+    ac->num_states = num_nodes;
+    ac->num_dense = num_nodes < DENSE_STATES ? num_nodes : DENSE_STATES;
+    ac->dense = xmalloc(sizeof(int) * 256 * ac->num_dense);
+    ac->edge_start = xmalloc(sizeof(int) * (num_nodes + 1));
+    ac->edge_label = xmalloc(num_nodes);
+    ac->edge_target = xmalloc(sizeof(int) * num_nodes);
+    ac->fail = xmalloc(sizeof(int) * num_nodes);
+    ac->output = xmalloc(sizeof(int) * num_nodes);
+
+    // Sorted edge lists, in state order.
+    int edges = 0;
+    for (int s = 0; s < num_nodes; s++) {
+        ac->edge_start[s] = edges;
+        for (int c = child[order[s]]; c != -1; c = sibling[c]) {
+            int j = edges++;
+            while (j > ac->edge_start[s] && ac->edge_label[j - 1] > label[c]) {
+                ac->edge_label[j] = ac->edge_label[j - 1];
+                ac->edge_target[j] = ac->edge_target[j - 1];
+                j--;
+            }
+            ac->edge_label[j] = label[c];
+            ac->edge_target[j] = number[c];
+        }
+    }
+    ac->edge_start[num_nodes] = edges;
+
+    // Failure links and outputs in breadth-first order. A state's failure
+    // link is shallower, hence already complete (and dense if the state is),
+    // so ac_step() can be used on it while building.
+    ac->fail[0] = 0;
+    ac->output[0] = -1;
+    for (int s = 0; s < num_nodes; s++) {
+        if (s > 0) {
+            int own = terminal[order[s]];
+            int inherited = ac->output[ac->fail[s]];
+            ac->output[s] = own >= 0 ? own : inherited;
+        }
+        for (int e = ac->edge_start[s]; e < ac->edge_start[s + 1]; e++) {
+            int target = ac->edge_target[e];
+            ac->fail[target] = s == 0 ? 0 : ac_step(ac, ac->fail[s], ac->edge_label[e]);
+        }
+        if (s < ac->num_dense) {
+            int *row = &ac->dense[s * 256];
+            for (int c = 0; c < 256; c++) {
+                row[c] = s == 0 ? 0 : ac->dense[ac->fail[s] * 256 + c];
+            }
+            for (int e = ac->edge_start[s]; e < ac->edge_start[s + 1]; e++) {
+                row[ac->edge_label[e]] = ac->edge_target[e];
+            }
+        }
+    }
+
+    free(order);
+    free(number);
+    free(child);
+    free(sibling);
+    free(label);
+    free(terminal);
+    return ac;
+}
+
+void ac_free(Automaton *ac) {
+    for (int i = 0; i < ac->num_patterns; i++) {
+        free(ac->patterns[i]);
+    }
+    free(ac->patterns);
+    free(ac->dense);
+    free(ac->edge_start);
+    free(ac->edge_label);
+    free(ac->edge_target);
+    free(ac->fail);
+    free(ac->output);
+    free(ac);
+}
+
+void search_file(FILE *file, const Query *query) {
     char *line = NULL;
     size_t len = 0;
     ssize_t read;
 
     while ((read = getline(&line, &len, file)) != -1) {
-        if (strstr(line, search_term) != NULL) {
+        if (query->ac) {
+            int pattern;
+            if (ac_find(query->ac, line, read, &pattern) != NULL) {
+                if (query->show_pattern) {
+                    printf("%s:", query->ac->patterns[pattern]);
+                }
+                fwrite(line, 1, read, stdout);
+            }
+        } else if (strstr(line, query->term) != NULL) {
             printf("%s", line);
         }
     }
@@ -18,28 +293,291 @@ void search_file(FILE *file, const char *search_term) {
     free(line);
 }
 
+// Find the first occurrence of term (term_len >= 1) in [hay, hay + len).
+// Candidates are filtered 16 positions at a time by comparing both the first
+// and the last byte of the term, so memcmp only runs where both agree.
+const char *find_term(const char *hay, size_t len, const char *term, size_t term_len) {
+    if (term_len > len) {
+        return NULL;
+    }
+    if (term_len == 1) {
+        return memchr(hay, term[0], len);
+    }
+
+    size_t last = len - term_len;   // last valid starting position
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(term[0]);
+    const __m128i tail = _mm_set1_epi8(term[term_len - 1]);
+
+    for (; i + 16 <= last + 1; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + term_len - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                        _mm_cmpeq_epi8(b, tail)));
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, term + 1, term_len - 2) == 0) {
+                return hay + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    while (i <= last) {
+        const char *p = memchr(hay + i, term[0], last - i + 1);
+        if (p == NULL) {
+            return NULL;
+        }
+        if (p[term_len - 1] == term[term_len - 1] && memcmp(p + 1, term + 1, term_len - 2) == 0) {
+            return p;
+        }
+        i = p - hay + 1;
+    }
+    return NULL;
+}
+
+void add_match(MatchList *list, size_t start, size_t end, int pattern) {
+    if (pattern < 0 && list->count > 0 && list->items[list->count - 1].end == start &&
+        list->items[list->count - 1].pattern < 0) {
+        list->items[list->count - 1].end = end;
+        return;
+    }
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->items = realloc(list->items, sizeof(Match) * list->capacity);
+        if (list->items == NULL) {
+            fprintf(stderr, "wgrep: out of memory\n");
+            exit(1);
+        }
+    }
+    list->items[list->count].start = start;
+    list->items[list->count].end = end;
+    list->items[list->count].pattern = pattern;
+    list->count++;
+}
+
+// Search the whole buffer rather than line by line: line boundaries are only
+// located around each match, then the search resumes after that line.
+void *search_range(void *arg) {
+    SearchTask *task = (SearchTask *)arg;
+    const Query *query = task->query;
+    const char *data = task->data;
+    size_t pos = task->begin;
+
+    while (pos < task->end) {
+        size_t start, end;
+        int pattern = -1;
+
+        if (query->ac == NULL && query->term_len == 0) {
+            start = pos;    // an empty term matches every line
+        } else {
+            const char *hit;
+            if (query->ac) {
+                // Resuming at a line start in the root state is exact, since
+                // a match never spans a newline.
+                hit = ac_find(query->ac, data + pos, task->end - pos, &pattern);
+                hit = hit ? hit - 1 : NULL;
+                if (!query->show_pattern) {
+                    pattern = -1;
+                }
+            } else {
+                hit = find_term(data + pos, task->end - pos, query->term, query->term_len);
+            }
+            if (hit == NULL) {
+                break;
+            }
+            const char *nl = memrchr(data + pos, '\n', hit - (data + pos));
+            start = nl ? (size_t)(nl - data) + 1 : pos;
+            pos = hit - data;
+        }
+
+        const char *nl = memchr(data + pos, '\n', task->end - pos);
+        end = nl ? (size_t)(nl - data) + 1 : task->end;
+        add_match(&task->matches, start, end, pattern);
+        pos = end;
+    }
+
+    return NULL;
+}
+
+void write_all(struct iovec *iov, int n) {
+    while (n > 0) {
+        ssize_t written = writev(STDOUT_FILENO, iov, n);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("wgrep");
+            exit(1);
+        }
+        // Skip the iovecs that went out completely and trim a partial one.
+        while (n > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+// Write the matching lines straight out of the mapping, in file order.
+void write_matches(const char *data, SearchTask *tasks, int num_tasks) {
+    struct iovec iov[IOV_BATCH];
+    int n = 0;
+
+    // Lines printed by search_file() may still sit in the stdio buffer.
+    fflush(stdout);
+
+    for (int t = 0; t < num_tasks; t++) {
+        for (size_t m = 0; m < tasks[t].matches.count; m++) {
+            Match *match = &tasks[t].matches.items[m];
+            if (match->pattern >= 0) {
+                if (n + 3 > IOV_BATCH) {
+                    write_all(iov, n);
+                    n = 0;
+                }
+                char *pattern = tasks[t].query->ac->patterns[match->pattern];
+                iov[n].iov_base = pattern;
+                iov[n].iov_len = strlen(pattern);
+                n++;
+                iov[n].iov_base = ":";
+                iov[n].iov_len = 1;
+                n++;
+            }
+            iov[n].iov_base = (void *)(data + match->start);
+            iov[n].iov_len = match->end - match->start;
+            if (++n == IOV_BATCH) {
+                write_all(iov, n);
+                n = 0;
+            }
+        }
+    }
+    write_all(iov, n);
+}
+
+// Search a mapped regular file. Large files are cut into one piece per
+// thread at newline boundaries; the pieces are written back in file order.
+void search_mapped(const char *data, size_t size, const Query *query, int num_threads) {
+    int num_tasks = size >= PARALLEL_MIN ? num_threads : 1;
+    SearchTask tasks[num_tasks];
+    pthread_t threads[num_tasks];
+    size_t begin = 0;
+
+    for (int t = 0; t < num_tasks; t++) {
+        size_t end = t == num_tasks - 1 ? size : size / num_tasks * (t + 1);
+        if (end < begin) {
+            end = begin;
+        }
+        if (end < size) {
+            const char *nl = memchr(data + end, '\n', size - end);
+            end = nl ? (size_t)(nl - data) + 1 : size;
+        }
+        tasks[t] = (SearchTask){ data, begin, end, query, { NULL, 0, 0 } };
+        begin = end;
+    }
+
+    for (int t = 1; t < num_tasks; t++) {
+        if (pthread_create(&threads[t], NULL, search_range, &tasks[t]) != 0) {
+            perror("wgrep");
+            exit(1);
+        }
+    }
+    search_range(&tasks[0]);
+    for (int t = 1; t < num_tasks; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    write_matches(data, tasks, num_tasks);
+    for (int t = 0; t < num_tasks; t++) {
+        free(tasks[t].matches.items);
+    }
+}
+
+void usage(void) {
+    printf("wgrep: [-p] -f patterns [file ...] | searchterm [file ...]\n");
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        printf("wgrep: searchterm [file ...]\n");
+    Query query = { NULL, 0, NULL, 0 };
+    int first_file = 2;
+
+    // -f patterns: search for every line of the patterns file in one pass.
+    // -p (with -f): print the pattern that matched in front of each line.
+    if (argc >= 2 && strcmp(argv[1], "-p") == 0) {
+        query.show_pattern = 1;
+        argv++;
+        argc--;
+    }
+    if (argc >= 2 && strcmp(argv[1], "-f") == 0) {
+        if (argc < 3) {
+            usage();
+            return 1;
+        }
+        FILE *patterns = fopen(argv[2], "r");
+        if (patterns == NULL) {
+            printf("wgrep: cannot open file\n");
+            return 1;
+        }
+        query.ac = ac_build(patterns);
+        fclose(patterns);
+        first_file = 3;
+    } else if (query.show_pattern || argc < 2) {
+        usage();
         return 1;
+    } else {
+        query.term = argv[1];
+        query.term_len = strlen(query.term);
     }
 
-    const char *search_term = argv[1];
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads < 1) num_threads = 1;
+    if (num_threads > MAX_THREADS) num_threads = MAX_THREADS;
 
-    if (argc == 2) {
-        search_file(stdin, search_term);
+    if (argc == first_file) {
+        search_file(stdin, &query);
     } else {
-        for (int i = 2; i < argc; i ++) {
-            FILE *file = fopen(argv[i], "r");
+        for (int i = first_file; i < argc; i ++) {
+            int fd = open(argv[i], O_RDONLY);
+            if (fd == -1) {
+                printf("wgrep: cannot open file\n");
+                return 1;
+            }
+
+            struct stat sb;
+            char *data = MAP_FAILED;
+            // A term spanning a newline can only match through getline().
+            if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0 &&
+                (query.term_len < 2 || memchr(query.term, '\n', query.term_len - 1) == NULL)) {
+                data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            }
+
+            if (data != MAP_FAILED) {
+                madvise(data, sb.st_size, MADV_SEQUENTIAL);
+                search_mapped(data, sb.st_size, &query, num_threads);
+                munmap(data, sb.st_size);
+                close(fd);
+                continue;
+            }
+
+            FILE *file = fdopen(fd, "r");
             if (file == NULL) {
                 printf("wgrep: cannot open file\n");
                 return 1;
             }
 
-            search_file(file, search_term);
+            search_file(file, &query);
             fclose(file);
         }
     }
 
+    if (query.ac) {
+        ac_free((Automaton *)query.ac);
+    }
     return 0;
-}
\ No newline at end of file
+}
@@ -1,31 +1,538 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define RECORD_SIZE 5                   // 4-byte run length followed by the character
+#define READ_SIZE (RECORD_SIZE << 18)   // 1.25 MB, always a whole number of records
+#define SEGMENT_RECORDS 16384           // records decoded as one unit (~80 KB compressed)
+#define SHORT_RUN 256                   // runs up to this length are expanded with memset
+#define FILL_SIZE 65536                 // longer runs are written from a pre-filled block
+#define IOV_BATCH 1024                  // iovecs handed to a single writev()
+#define PARALLEL_MIN (4 << 20)          // smaller inputs are decoded on the calling thread
+#define MAX_THREADS 64
+#define INDEX_MAGIC "WZIX"
+#define TRAILER_SIZE 32
+
+// A piece of decoded output: either a slice of the segment's data buffer,
+// or a long run of one character that is never materialized.
+typedef struct {
+    size_t off;
+    size_t len;
+    int fill;                  // character of a long run, or -1 for a data slice
+} Piece;
+
+// Decoded form of up to SEGMENT_RECORDS records. Short runs are expanded into
+// data (at most SEGMENT_RECORDS * SHORT_RUN bytes), long runs become pieces.
+typedef struct {
+    char *data;
+    size_t data_len;
+    Piece *pieces;
+    int num_pieces;
+} Segment;
+
+// Shared state for decoding one mapped file with several threads. Workers claim
+// segments in order and decode them into a ring of slots; the main thread
+// writes the slots out in order and hands them back.
+typedef struct {
+    const char *records;
+    size_t num_records;
+    size_t num_segments;
+    size_t next_segment;       // next segment to be claimed by a worker
+    size_t written;            // segments already written to stdout
+    Segment *slots;
+    long *ready;               // segment number held by each slot, or -1
+    int num_slots;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} ParallelDecode;
+
+// Index written by wzip -i; see wzip.c for the container layout. Entries are
+// not aligned in the file, so they are read with memcpy.
+typedef struct {
+    uint64_t uncompressed;
+    uint64_t compressed;
+} IndexEntry;
+
+typedef struct {
+    size_t records_size;       // bytes of records before the end marker
+    const char *entries;
+    uint64_t num_entries;
+    uint64_t total_size;       // uncompressed size of the whole stream
+} Index;
+
+static char *fill_blocks[256];
+static struct iovec iov[IOV_BATCH];
+static int iov_count = 0;
+
+void segment_init(Segment *seg) {
+    seg->data = malloc((size_t)SEGMENT_RECORDS * SHORT_RUN);
+    seg->pieces = malloc(sizeof(Piece) * SEGMENT_RECORDS);
+    if (!seg->data || !seg->pieces) {
+        fprintf(stderr, "wunzip: out of memory\n");
+        exit(1);
+    }
+    seg->data_len = 0;
+    seg->num_pieces = 0;
+}
+
+void segment_free(Segment *seg) {
+    free(seg->data);
+    free(seg->pieces);
+}
+
+// Decode n (<= SEGMENT_RECORDS) records into seg, replacing its contents.
+void decode_segment(Segment *seg, const char *records, size_t n) {
+    seg->data_len = 0;
+    seg->num_pieces = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        const char *rec = records + i * RECORD_SIZE;
+        int count;
+        memcpy(&count, rec, sizeof(int));
+        if (count <= 0) {
+            continue;
+        }
+
+        unsigned char character = rec[sizeof(int)];
+        Piece *last = seg->num_pieces > 0 ? &seg->pieces[seg->num_pieces - 1] : NULL;
+
+        if (count <= SHORT_RUN) {
+            memset(seg->data + seg->data_len, character, count);
+            if (last && last->fill < 0) {
+                last->len += count;
+            } else {
+                seg->pieces[seg->num_pieces++] = (Piece){ seg->data_len, count, -1 };
+            }
+            seg->data_len += count;
+        } else {
+            seg->pieces[seg->num_pieces++] = (Piece){ 0, count, character };
+        }
+    }
+}
+
+void write_fully(void) {
+    struct iovec *v = iov;
+    int n = iov_count;
+
+    while (n > 0) {
+        ssize_t written = writev(STDOUT_FILENO, v, n);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("wunzip");
+            exit(1);
+        }
+        // Skip the iovecs that went out completely and trim a partial one.
+        while (n > 0 && (size_t)written >= v->iov_len) {
+            written -= v->iov_len;
+            v++;
+            n--;
+        }
+        if (n > 0) {
+            v->iov_base = (char *)v->iov_base + written;
+            v->iov_len -= written;
+        }
+    }
+    iov_count = 0;
+}
+
+void output_add(const char *buf, size_t len) {
+    if (iov_count == IOV_BATCH) {
+        write_fully();
+    }
+    iov[iov_count].iov_base = (void *)buf;
+    iov[iov_count].iov_len = len;
+    iov_count++;
+}
+
+// Queue len copies of character. The iovecs point repeatedly at a single block
+// of that character, so a billion-byte run costs ~15k iovecs and no copying.
+void output_run(int character, size_t len) {
+    if (!fill_blocks[character]) {
+        if ((fill_blocks[character] = malloc(FILL_SIZE)) == NULL) {
+            fprintf(stderr, "wunzip: out of memory\n");
+            exit(1);
+        }
+        memset(fill_blocks[character], character, FILL_SIZE);
+    }
+    for (size_t left = len; left > 0; ) {
+        size_t chunk = left < FILL_SIZE ? left : FILL_SIZE;
+        output_add(fill_blocks[character], chunk);
+        left -= chunk;
+    }
+}
+
+void emit_segment(Segment *seg) {
+    for (int i = 0; i < seg->num_pieces; i++) {
+        Piece *p = &seg->pieces[i];
+        if (p->fill < 0) {
+            output_add(seg->data + p->off, p->len);
+        } else {
+            output_run(p->fill, p->len);
+        }
+    }
+    // The segment is about to be reused, so nothing may stay queued.
+    write_fully();
+}
+
+void decode_serial(Segment *seg, const char *records, size_t num_records) {
+    for (size_t i = 0; i < num_records; i += SEGMENT_RECORDS) {
+        size_t n = num_records - i < SEGMENT_RECORDS ? num_records - i : SEGMENT_RECORDS;
+        decode_segment(seg, records + i * RECORD_SIZE, n);
+        emit_segment(seg);
+    }
+}
+
+void *decode_worker(void *arg) {
+    ParallelDecode *pd = (ParallelDecode *)arg;
+
+    while (1) {
+        pthread_mutex_lock(&pd->mutex);
+        if (pd->next_segment >= pd->num_segments) {
+            pthread_mutex_unlock(&pd->mutex);
+            break;
+        }
+        size_t id = pd->next_segment++;
+        // Backpressure: wait until the writer has drained the slot we need.
+        while (id - pd->written >= (size_t)pd->num_slots) {
+            pthread_cond_wait(&pd->cond, &pd->mutex);
+        }
+        pthread_mutex_unlock(&pd->mutex);
+
+        size_t first = id * SEGMENT_RECORDS;
+        size_t n = pd->num_records - first < SEGMENT_RECORDS ? pd->num_records - first : SEGMENT_RECORDS;
+        int slot = id % pd->num_slots;
+        decode_segment(&pd->slots[slot], pd->records + first * RECORD_SIZE, n);
+
+        pthread_mutex_lock(&pd->mutex);
+        pd->ready[slot] = id;
+        pthread_cond_broadcast(&pd->cond);
+        pthread_mutex_unlock(&pd->mutex);
+    }
+
+    return NULL;
+}
+
+void decode_parallel(const char *records, size_t num_records, int num_threads) {
+    ParallelDecode pd = {
+        .records = records,
+        .num_records = num_records,
+        .num_segments = (num_records + SEGMENT_RECORDS - 1) / SEGMENT_RECORDS,
+        .next_segment = 0,
+        .written = 0,
+        .num_slots = num_threads * 2
+    };
+    pthread_t threads[num_threads];
+
+    pd.slots = malloc(sizeof(Segment) * pd.num_slots);
+    pd.ready = malloc(sizeof(long) * pd.num_slots);
+    if (!pd.slots || !pd.ready) {
+        fprintf(stderr, "wunzip: out of memory\n");
+        exit(1);
+    }
+    for (int s = 0; s < pd.num_slots; s++) {
+        segment_init(&pd.slots[s]);
+        pd.ready[s] = -1;
+    }
+    pthread_mutex_init(&pd.mutex, NULL);
+    pthread_cond_init(&pd.cond, NULL);
+
+    for (int t = 0; t < num_threads; t++) {
+        if (pthread_create(&threads[t], NULL, decode_worker, &pd) != 0) {
+            perror("wunzip");
+            exit(1);
+        }
+    }
+
+    for (size_t id = 0; id < pd.num_segments; id++) {
+        int slot = id % pd.num_slots;
+
+        pthread_mutex_lock(&pd.mutex);
+        while (pd.ready[slot] != (long)id) {
+            pthread_cond_wait(&pd.cond, &pd.mutex);
+        }
+        pthread_mutex_unlock(&pd.mutex);
+
+        emit_segment(&pd.slots[slot]);
+
+        pthread_mutex_lock(&pd.mutex);
+        pd.ready[slot] = -1;
+        pd.written++;
+        pthread_cond_broadcast(&pd.cond);
+        pthread_mutex_unlock(&pd.mutex);
+    }
+
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    pthread_cond_destroy(&pd.cond);
+    pthread_mutex_destroy(&pd.mutex);
+    for (int s = 0; s < pd.num_slots; s++) {
+        segment_free(&pd.slots[s]);
+    }
+    free(pd.slots);
+    free(pd.ready);
+}
+
+void decode_records(Segment *seg, const char *records, size_t num_records, int num_threads) {
+    if (num_records * RECORD_SIZE >= PARALLEL_MIN && num_threads > 1) {
+        decode_parallel(records, num_records, num_threads);
+    } else {
+        decode_serial(seg, records, num_records);
+    }
+}
+
+// Number of records before the zero-count marker that ends a wzip -i stream,
+// or n if the marker is not among them.
+size_t records_before_marker(const char *records, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        int count;
+        memcpy(&count, records + i * RECORD_SIZE, sizeof(int));
+        if (count == 0) {
+            return i;
+        }
+    }
+    return n;
+}
+
+// Fallback for pipes and anything else that cannot be mapped: read large
+// blocks and carry a partial record over to the next read.
+void decode_stream(int fd, Segment *seg) {
+    char *buffer = malloc(READ_SIZE);
+    size_t have = 0;
+    ssize_t n;
+
+    if (!buffer) {
+        fprintf(stderr, "wunzip: out of memory\n");
+        exit(1);
+    }
+
+    while ((n = read(fd, buffer + have, READ_SIZE - have)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("wunzip");
+            exit(1);
+        }
+        have += n;
+        size_t whole = have / RECORD_SIZE;
+        size_t before_marker = records_before_marker(buffer, whole);
+        decode_serial(seg, buffer, before_marker);
+        if (before_marker < whole) {
+            break;   // the rest is the index of a wzip -i container
+        }
+        memmove(buffer, buffer + whole * RECORD_SIZE, have - whole * RECORD_SIZE);
+        have -= whole * RECORD_SIZE;
+    }
+
+    free(buffer);
+}
+
+// Recognize a wzip -i container by its trailer and check that the pieces add
+// up to the file size, so a plain stream is never mistaken for one.
+int read_index(const char *data, size_t size, Index *idx) {
+    uint64_t records_size, num_entries, total_size;
+
+    if (size < TRAILER_SIZE || memcmp(data + size - 4, INDEX_MAGIC, 4) != 0) {
+        return 0;
+    }
+    const char *trailer = data + size - TRAILER_SIZE;
+    memcpy(&records_size, trailer, sizeof(uint64_t));
+    memcpy(&num_entries, trailer + 8, sizeof(uint64_t));
+    memcpy(&total_size, trailer + 16, sizeof(uint64_t));
+
+    if (records_size % RECORD_SIZE != 0 || records_size > size ||
+        num_entries > size / sizeof(IndexEntry) ||
+        records_size + RECORD_SIZE + num_entries * sizeof(IndexEntry) + TRAILER_SIZE != size) {
+        return 0;
+    }
+
+    idx->records_size = records_size;
+    idx->entries = data + records_size + RECORD_SIZE;
+    idx->num_entries = num_entries;
+    idx->total_size = total_size;
+    return 1;
+}
+
+IndexEntry index_entry(const Index *idx, uint64_t i) {
+    IndexEntry e;
+    memcpy(&e, idx->entries + i * sizeof(IndexEntry), sizeof(IndexEntry));
+    return e;
+}
+
+// Find the record holding uncompressed byte pos, scanning from the closest
+// index entry at or before it. Returns num_records if pos is past the end;
+// *start is set to the uncompressed offset of the returned record.
+size_t locate(const char *records, size_t num_records, const Index *idx,
+              uint64_t pos, uint64_t *start) {
+    size_t rec = 0;
+    uint64_t offset = 0;
+
+    if (idx && idx->num_entries > 0) {
+        uint64_t lo = 0, hi = idx->num_entries;
+        while (hi - lo > 1) {
+            uint64_t mid = lo + (hi - lo) / 2;
+            if (index_entry(idx, mid).uncompressed <= pos) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        IndexEntry e = index_entry(idx, lo);
+        // The trailer only vouches for the layout; an entry must still point
+        // at a record of this file, and at or before pos.
+        if (e.compressed % RECORD_SIZE != 0 || e.compressed / RECORD_SIZE > num_records ||
+            e.uncompressed > pos) {
+            fprintf(stderr, "wunzip: corrupt index entry %llu\n", (unsigned long long)lo);
+            exit(1);
+        }
+        rec = e.compressed / RECORD_SIZE;
+        offset = e.uncompressed;
+    }
+
+    for (; rec < num_records; rec++) {
+        int count;
+        memcpy(&count, records + rec * RECORD_SIZE, sizeof(int));
+        if (count > 0 && offset + count > pos) {
+            break;
+        }
+        if (count > 0) {
+            offset += count;
+        }
+    }
+
+    *start = offset;
+    return rec;
+}
+
+// Write bytes [off, off + len) of the original data. Only the records that
+// overlap the range are touched; the ones strictly inside it are decoded like
+// a whole file, in parallel when there are enough of them.
+void decode_range(Segment *seg, const char *records, size_t num_records, const Index *idx,
+                  uint64_t off, uint64_t len, int num_threads) {
+    uint64_t first_start, last_start;
+    uint64_t end = off + len < off ? UINT64_MAX : off + len;
+
+    if (len == 0) {
+        return;
+    }
+    size_t first = locate(records, num_records, idx, off, &first_start);
+    if (first == num_records) {
+        return;
+    }
+    size_t last = locate(records, num_records, idx, end - 1, &last_start);
+
+    int count;
+    memcpy(&count, records + first * RECORD_SIZE, sizeof(int));
+    uint64_t take = first_start + count - off;
+    if (take > len) {
+        take = len;
+    }
+    output_run((unsigned char)records[first * RECORD_SIZE + sizeof(int)], take);
+    if (first == last) {
+        write_fully();
+        return;
+    }
+
+    decode_records(seg, records + (first + 1) * RECORD_SIZE, last - first - 1, num_threads);
+
+    if (last < num_records) {
+        output_run((unsigned char)records[last * RECORD_SIZE + sizeof(int)], end - last_start);
+    }
+    write_fully();
+}
+
+// Parse "off:len" for --range.
+int parse_range(const char *arg, uint64_t *off, uint64_t *len) {
+    char *colon, *end;
+
+    *off = strtoull(arg, &colon, 10);
+    if (colon == arg || *colon != ':') {
+        return 0;
+    }
+    *len = strtoull(colon + 1, &end, 10);
+    return end != colon + 1 && *end == '\0';
+}
 
 int main(int argc, char *argv[]) {
+    int range = 0;
+    uint64_t range_off = 0, range_len = 0;
+
+    if (argc >= 2 && strcmp(argv[1], "--range") == 0) {
+        if (argc != 4 || !parse_range(argv[2], &range_off, &range_len)) {
+            printf("wunzip: --range off:len file\n");
+            exit(1);
+        }
+        range = 1;
+    }
+
     if (argc < 2) {
         printf("wunzip: file1 [file2 ...]\n");
         exit(1);
     }
 
-    int count;
-    char character;
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads < 1) num_threads = 1;
+    if (num_threads > MAX_THREADS) num_threads = MAX_THREADS;
+
+    Segment seg;
+    segment_init(&seg);
 
-    for (int i = 1; i < argc; i ++) {
-        FILE *file = fopen(argv[i], "r");
-        if (!file) {
+    for (int i = range ? 3 : 1; i < argc; i ++) {
+        int fd = open(argv[i], O_RDONLY);
+        if (fd == -1) {
             perror("wunzip");
             exit(1);
         }
 
-        while (fread(&count, sizeof(int), 1, file) == 1 && 
-               fread(&character, sizeof(char), 1, file) == 1) {
-                for (int j = 0; j < count; j ++) {
-                    putchar(character);
-                }
+        struct stat sb;
+        char *data = MAP_FAILED;
+        if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode)) {
+            if (sb.st_size == 0) {
+                // No records, so any range of it is empty too.
+                close(fd);
+                continue;
+            }
+            data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+
+        if (data == MAP_FAILED) {
+            if (range) {
+                fprintf(stderr, "wunzip: --range needs a regular file\n");
+                exit(1);
+            }
+            decode_stream(fd, &seg);
+        } else {
+            Index idx;
+            int indexed = read_index(data, sb.st_size, &idx);
+            // A trailing partial record is ignored, as a short fread would be.
+            size_t num_records = (indexed ? idx.records_size : (size_t)sb.st_size) / RECORD_SIZE;
+
+            if (range) {
+                decode_range(&seg, data, num_records, indexed ? &idx : NULL,
+                             range_off, range_len, num_threads);
+            } else {
+                madvise(data, sb.st_size, MADV_SEQUENTIAL);
+                decode_records(&seg, data, num_records, num_threads);
+            }
+            munmap(data, sb.st_size);
         }
 
-        fclose(file);
+        close(fd);
     }
 
+    segment_free(&seg);
     return 0;
-}
\ No newline at end of file
+}
@@ -1,16 +1,100 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define INDEX_INTERVAL 4096   // default records between index entries
+#define INDEX_MAGIC "WZIX"
+
+/*
+ * With -i, wzip writes a seekable container instead of a bare record stream:
+ *
+ *   records   (count, char) records, exactly as without -i
+ *   marker    one record with count 0, which ends the record stream
+ *   entries   { uint64 uncompressed offset, uint64 compressed offset } of every
+ *             K-th record, starting with record 0
+ *   trailer   { uint64 records size, uint64 number of entries,
+ *               uint64 uncompressed size, uint32 K, char magic[4] = "WZIX" }
+ *
+ * wunzip finds the trailer at the end of the file and uses the entries for
+ * --range; the layout must stay in sync with wunzip.c.
+ */
+typedef struct {
+    uint64_t uncompressed;
+    uint64_t compressed;
+} IndexEntry;
+
+int build_index = 0;
+long interval = INDEX_INTERVAL;
+IndexEntry *entries = NULL;
+uint64_t num_entries = 0, entries_capacity = 0;
+uint64_t num_records = 0, total_size = 0;
+
+void write_record(int count, int character) {
+    if (build_index && num_records % interval == 0) {
+        if (num_entries == entries_capacity) {
+            entries_capacity = entries_capacity ? entries_capacity * 2 : 1024;
+            entries = realloc(entries, sizeof(IndexEntry) * entries_capacity);
+            if (!entries) {
+                fprintf(stderr, "wzip: out of memory\n");
+                exit(1);
+            }
+        }
+        entries[num_entries].uncompressed = total_size;
+        entries[num_entries].compressed = num_records * 5;
+        num_entries++;
+    }
+
+    fwrite(&count, sizeof(int), 1, stdout);
+    fwrite(&character, sizeof(char), 1, stdout);
+    num_records++;
+    total_size += count;
+}
+
+void write_index(void) {
+    uint64_t records_size = num_records * 5;
+    uint32_t k = interval;
+    int zero = 0;
+
+    fwrite(&zero, sizeof(int), 1, stdout);
+    fwrite(&zero, sizeof(char), 1, stdout);
+    fwrite(entries, sizeof(IndexEntry), num_entries, stdout);
+    fwrite(&records_size, sizeof(records_size), 1, stdout);
+    fwrite(&num_entries, sizeof(num_entries), 1, stdout);
+    fwrite(&total_size, sizeof(total_size), 1, stdout);
+    fwrite(&k, sizeof(k), 1, stdout);
+    fwrite(INDEX_MAGIC, sizeof(char), 4, stdout);
+}
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        printf("wzip: file1 [file2 ...]\n");
+    int opt;
+    while ((opt = getopt(argc, argv, "ik:")) != -1) {
+        switch (opt) {
+        case 'i':
+            build_index = 1;
+            break;
+        case 'k':
+            interval = atol(optarg);
+            if (interval <= 0) {
+                printf("wzip: [-i] [-k interval] file1 [file2 ...]\n");
+                exit(1);
+            }
+            break;
+        default:
+            printf("wzip: [-i] [-k interval] file1 [file2 ...]\n");
+            exit(1);
+        }
+    }
+
+    if (optind >= argc) {
+        printf("wzip: [-i] [-k interval] file1 [file2 ...]\n");
         exit(1);
     }
 
     int count = 0;
     int current_char, prev_char = EOF;
 
-    for (int i = 1; i < argc; i++) {
+    for (int i = optind; i < argc; i++) {
         FILE *file = fopen(argv[i], "r");
         if (!file) {
             perror("wzip");
@@ -19,8 +103,7 @@ int main(int argc, char *argv[]) {
 
         while ((current_char = fgetc(file)) != EOF) {
             if (current_char != prev_char && prev_char != EOF) {
-                fwrite(&count, sizeof(int), 1, stdout);
-                fwrite(&prev_char, sizeof(char), 1, stdout);
+                write_record(count, prev_char);
                 count = 0;
             }
             prev_char = current_char;
@@ -31,9 +114,13 @@ int main(int argc, char *argv[]) {
     }
 
     if (count > 0) {
-        fwrite(&count, sizeof(int), 1, stdout);
-        fwrite(&prev_char, sizeof(char), 1, stdout);
+        write_record(count, prev_char);
+    }
+
+    if (build_index) {
+        write_index();
+        free(entries);
     }
 
     return 0;
-}
\ No newline at end of file
+}
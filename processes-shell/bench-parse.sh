@@ -0,0 +1,34 @@
+#! /bin/bash
+#
+# Benchmark for wish's parser: generates scripts of a few MB and times "wish -n", which parses every line and runs
+# nothing. Three shapes: many short lines; pipelines with redirections and quoting; and lines of 50000 arguments.
+#
+#     prompt> ./bench-parse.sh [megabytes]
+
+if ! [[ -x wish ]]; then
+    echo "wish executable does not exist"
+    exit 1
+fi
+
+mb=${1:-8}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+awk -v bytes=$((mb << 20)) 'BEGIN {
+    for (n = 0; n < bytes; n += length(l) + 1) { l = "ls -l /tmp/dir" i++ " &  echo done"; print l }
+}' > "$dir/short"
+awk -v bytes=$((mb << 20)) 'BEGIN {
+    for (n = 0; n < bytes; n += length(l) + 1) { l = "cat \"file " i++ ".txt\" | grep -v '\''a|b'\'' | sort -u > out\\ " i; print l }
+}' > "$dir/mixed"
+awk -v bytes=$((mb << 20)) 'BEGIN {
+    for (n = 0; n < bytes; n++) { printf "echo"; for (i = 0; i < 50000; i++) { a = " arg" i; printf "%s", a; n += length(a) } print "" }
+}' > "$dir/long"
+
+for shape in short mixed long; do
+    lines=$(wc -l < "$dir/$shape")
+    start=$(date +%s%N)
+    ./wish -n "$dir/$shape" || exit 1
+    end=$(date +%s%N)
+    awk -v s=$shape -v l=$lines -v mb=$mb -v t=$(((end - start) / 1000)) \
+        'BEGIN { printf "%-6s %4d MB %9d lines %8.3f s %8.1f MB/s\n", s, mb, l, t / 1e6, mb / (t / 1e6) }'
+done
@@ -0,0 +1,118 @@
+/*
+ *Microbenchmark for process launch: starts /bin/true N times (1000 by default) with fork + execv, the way wish
+ *used to, and with posix_spawn, the way it does now, waiting for each child before starting the next. The
+ *launching process first touches M megabytes of heap (64 by default), standing in for a shell that holds a lot of
+ *state: fork has to copy the page tables for all of it, posix_spawn does not.
+ *
+ *    prompt> gcc -O2 -o spawn-bench spawn-bench.c && ./spawn-bench [launches] [megabytes]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+char *true_args[] = { "/bin/true", NULL };
+
+double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void report(const char *method, int launches, double seconds)
+{
+	printf("%-12s %8d launches %8.3f s %10.1f us/launch %10.0f launches/s\n",
+		method, launches, seconds, seconds * 1e6 / launches, launches / seconds);
+}
+
+/*
+ *Start /bin/true with fork and execv and wait for it. Returns 0 on success.
+ */
+int launch_fork(void)
+{
+	int status;
+	pid_t pid = fork();
+
+	if (pid == 0)
+	{
+		execv(true_args[0], true_args);
+		_exit(127);
+	}
+	else if (pid < 0)
+	{
+		return -1;
+	}
+
+	return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/*
+ *Start /bin/true with posix_spawn and wait for it. Returns 0 on success.
+ */
+int launch_spawn(void)
+{
+	int status;
+	pid_t pid;
+
+	if (posix_spawn(&pid, true_args[0], NULL, NULL, true_args, environ) != 0)
+	{
+		return -1;
+	}
+
+	return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+	int launches = argc > 1 ? atoi(argv[1]) : 1000;
+	long megabytes = argc > 2 ? atol(argv[2]) : 64;
+	int i;
+	double start;
+
+	if (launches <= 0 || megabytes < 0)
+	{
+		fprintf(stderr, "usage: spawn-bench [launches] [megabytes]\n");
+		exit(1);
+	}
+
+	// Touch every page so that it is mapped and has to be accounted for by fork
+	size_t size = megabytes << 20;
+	char *state = malloc(size ? size : 1);
+	if (state == NULL)
+	{
+		fprintf(stderr, "Memory allocation failed\n");
+		exit(1);
+	}
+	memset(state, 1, size);
+
+	start = now();
+	for (i = 0; i < launches; i++)
+	{
+		if (launch_fork() != 0)
+		{
+			fprintf(stderr, "spawn-bench: fork launch failed\n");
+			exit(1);
+		}
+	}
+	report("fork+execv", launches, now() - start);
+
+	start = now();
+	for (i = 0; i < launches; i++)
+	{
+		if (launch_spawn() != 0)
+		{
+			fprintf(stderr, "spawn-bench: posix_spawn launch failed\n");
+			exit(1);
+		}
+	}
+	report("posix_spawn", launches, now() - start);
+
+	free(state);
+	return 0;
+}
@@ -1,50 +1,185 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
+#define _GNU_SOURCE	// F_SETPIPE_SZ, pipe2
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#define MAX_COMMAND_LENGTH 256
+#include <errno.h>
+#include <spawn.h>
+#include <time.h>
+#define HASH_BUCKETS 256
+#define REPORT_SLOWEST 10
+
+extern char **environ;
 
 void execute_cd(char **arg);
 void execute_exit(char **arg);
 char *execute_path(char **arg, char *path);
-void check_bash_mode(int argc, char *argv[]);
+void check_bash_mode(char *script);
 void print_prompt(int interactive);
-int separate_command(char command[]);
-void split_command(int p);
-void check_redirection(void);
+int parse_line(char *line);
+void select_stage(int stage);
+char *lookup_command(const char *name, const char *search);
+void forget_command(const char *name);
+void clear_commands(void);
+int spawn_command(const char *search);
+void run_pipeline(int command, const char *search, int timed);
+void execute_pipesize(char **arg);
+int is_builtin(const char *name);
+void wait_for_slots(int needed);
+void drain_jobs(void);
+double now(void);
+void add_job(pid_t pid, double start);
+void start_timing(void);
+void finish_timing(void);
+void write_report(char *script);
 
 char error_message[30] = "An error has occurred";
 
+/*
+ *The command_info struct describes one of the commands of a line, i.e. a pipeline.
+ *Fields:
+ *- first: The index of its first stage in shell.stages.
+ *- count: The number of stages, 1 if it is not a pipeline.
+ */
+typedef struct command_info
+{
+	int first;
+	int count;
+}
+
+command_info;
+
+/*
+ *The stage_info struct describes one stage of a pipeline as it was parsed.
+ *Fields:
+ *- first: The index of its arguments in shell.words.
+ *- argc: The number of arguments.
+ *- redirects: The number of '>' in the stage.
+ *- filename: The word following '>', if any.
+ *- badRedirect: Flag indicating if the redirection is malformed (1), e.g. has no file or more than one.
+ */
+typedef struct stage_info
+{
+	int first;
+	int argc;
+	int redirects;
+	char *filename;
+	int badRedirect;
+}
+
+stage_info;
+
+/*
+ *The job_usage struct holds what a child process used.
+ *Fields:
+ *- real: Wall-clock seconds from its start until it was reaped.
+ *- user: CPU seconds in user mode, as reported by wait4.
+ *- sys: CPU seconds in the kernel, as reported by wait4.
+ *- maxrss: Its peak resident set size in kilobytes.
+ *- status: Its exit status, or 128 plus the number of the signal that ended it.
+ */
+typedef struct job_usage
+{
+	double real;
+	double user;
+	double sys;
+	long maxrss;
+	int status;
+}
+
+job_usage;
+
+/*
+ *The job_info struct describes a child process, while it runs and, for the report, once it has ended.
+ *Fields:
+ *- pid: Its process id.
+ *- start: When it was started, in seconds on the monotonic clock.
+ *- line: The number of the input line it came from.
+ *- timed: Flag indicating if it is part of a command run by the 'time' built-in (1) or not (0).
+ *- command: Its arguments joined by spaces, only kept when a report is written.
+ *- usage: What it used, once it has ended.
+ */
+typedef struct job_info
+{
+	pid_t pid;
+	double start;
+	int line;
+	int timed;
+	char *command;
+	job_usage usage;
+}
+
+job_info;
+
 /*
  *The shell_info struct stores the current state and settings of the shell.
  *It helps to manage the shell's variables and keeps the code organized.
  *Fields:
  *- notAllowed: Flag indicating if a command is allowed to be executed (0) or not (1).
  *- interactive: Flag indicating if the shell is running in interactive mode (1) or batch mode (0).
- *- commands: Array of pointers to strings storing the commands entered by the user.
- *- args: Array of pointers to strings storing the arguments for each command entered by the user.
+ *- commands: The commands of the current line, separated by '&'; each is a run of stages.
+ *- stages: The stages of those commands, separated by '|'; a command that is not a pipeline has one.
+ *- words: The argument arrays of all stages, one after the other, each terminated by a NULL pointer. The strings
+ *  themselves stay in the line buffer. The three arrays grow as needed and are reused from line to line.
+ *- args: The arguments of the stage being run, pointing into 'words'.
  *- filename: Pointer to a string containing the name of the file to be redirected, if any.
  *- outputRedirect: Flag indicating if output redirection is required (1) or not (0).
- *- multipleFiles: Flag indicating if multiple files need to be processed (1) or not (0).
+ *- multipleFiles: Flag indicating if the redirection is malformed (1), e.g. names multiple files, or not (0).
+ *- actions: File actions that a spawned command runs with, i.e. the output redirection, if any.
  *- current_command: Integer representing the index of the current command being executed in the 'commands' array.
+ *- parseOnly: With -n, lines are parsed and checked but not run.
+ *- pipeSize: Buffer size in bytes requested for each pipe of a pipeline, or 0 for the system default.
+ *- maxJobs: With -j N, the number of child processes allowed to run at once across lines; 0 means each line is
+ *  waited for before the next one is read.
+ *- jobs: The child processes started and not yet reaped; 'running' of them are in use.
+ *- lineNumber: The number of the line being run.
+ *- timing: Flag indicating if the processes being started make up a command run by 'time' (1) or not (0).
+ *- timedRunning: The number of those still running.
+ *- timedLast: The process id of the last of them, whose status is the command's, or 0 if none was started.
+ *- timedUsage: Their totals; 'real' holds the time the command was started until it is printed.
+ *- report: With -r file, where the summary report is written at the end, otherwise NULL.
+ *- startTime: When the shell started, for the report.
+ *- finished, failed, peakRunning, total: The number of jobs that ended, those that ended with a status other
+ *  than 0, the most that ran at once, and the sum of what they used.
+ *- slowest: The REPORT_SLOWEST jobs with the longest wall-clock time so far, slowest first; 'numSlowest' are used.
  *- stream: File pointer to the input stream for the shell (stdin by default, can be changed for batch mode).
  */
 typedef struct shell_info
 {
 	int notAllowed;
 	int interactive;
-	char *commands[100];
-	char *args[100];
+	command_info *commands;
+	int numCommands, commandsCap;
+	stage_info *stages;
+	int numStages, stagesCap;
+	char **words;
+	int numWords, wordsCap;
+	char **args;
 	char *filename;
 	int outputRedirect;
 	int multipleFiles;
+	posix_spawn_file_actions_t actions;
 	int current_command;
+	int pipeSize;
+	int maxJobs;
+	job_info *jobs;
+	int running, jobsCap;
+	int lineNumber;
+	int timing;
+	int timedRunning;
+	pid_t timedLast;
+	job_usage timedUsage;
+	char *report;
+	double startTime;
+	int finished, failed, peakRunning;
+	job_usage total;
+	job_info slowest[REPORT_SLOWEST];
+	int numSlowest;
+	int parseOnly;
 	FILE * stream;
 }
 
@@ -52,13 +187,41 @@ shell_info;
 
 shell_info shell;
 
+/*
+ *The command hash remembers where each command was found on the search path, like bash's `hash`, so that the
+ *directories are only searched the first time a command is run. Entries are chained per bucket.
+ *Fields:
+ *- name: The command as typed.
+ *- fullpath: The executable it resolved to.
+ *- next: The next entry in the same bucket.
+ */
+typedef struct hash_entry
+{
+	char *name;
+	char *fullpath;
+	struct hash_entry *next;
+}
+
+hash_entry;
+
+hash_entry *command_hash[HASH_BUCKETS];
+
 void initialize_shell(void)
 {
 	shell.notAllowed = 0;
 	shell.interactive = 1;
 	shell.outputRedirect = 0;
 	shell.multipleFiles = 0;
+	posix_spawn_file_actions_init(&shell.actions);
 	shell.current_command = 0;
+	shell.pipeSize = 0;
+	shell.maxJobs = 0;
+	shell.running = 0;
+	shell.lineNumber = 0;
+	shell.timing = 0;
+	shell.report = NULL;
+	shell.startTime = now();
+	shell.parseOnly = 0;
 	shell.stream = stdin;
 }
 
@@ -134,15 +297,15 @@ char *execute_path(char **arg, char *path)
 
 /*
  *Check the mode of operation for the shell program based on command-line arguments
- *If the shell is running in non-interactive mode, open the specified file for reading
+ *If the shell is running in non-interactive mode, i.e. a script was given, open the specified file for reading
  *and set the shell's stream to the file stream
  */
-void check_bash_mode(int argc, char *argv[])
+void check_bash_mode(char *script)
 {
-	if (argc == 2)
+	if (script != NULL)
 	{
 		shell.interactive = 0;
-		if ((shell.stream = fopen(argv[1], "r")) == NULL)
+		if ((shell.stream = fopen(script, "r")) == NULL)
 		{
 			fprintf(stderr, "%s\n", error_message);
 			exit(1);
@@ -150,6 +313,135 @@ void check_bash_mode(int argc, char *argv[])
 	}
 }
 
+/*
+ *FNV-1a hash of a command name, reduced to a bucket index.
+ */
+unsigned hash_name(const char *name)
+{
+	unsigned h = 2166136261u;
+	for (; *name; name++)
+	{
+		h = (h ^ (unsigned char) *name) * 16777619u;
+	}
+
+	return h % HASH_BUCKETS;
+}
+
+/*
+ *The resolve_command function searches the directories of 'search', a colon-separated list, in order for an
+ *executable called 'name'. Empty entries are skipped.
+ *
+ *Return:
+ *- A newly allocated full path, or NULL if no directory has the command.
+ */
+char *resolve_command(const char *name, const char *search)
+{
+	const char *dir = search;
+	size_t name_len = strlen(name);
+
+	while (*dir != '\0')
+	{
+		const char *end = strchr(dir, ':');
+		size_t len = end ? (size_t)(end - dir) : strlen(dir);
+
+		if (len > 0)
+		{
+			char *fullpath = malloc(len + name_len + 2);
+			memcpy(fullpath, dir, len);
+			fullpath[len] = '/';
+			memcpy(fullpath + len + 1, name, name_len + 1);
+			if (access(fullpath, X_OK) == 0)
+			{
+				return fullpath;
+			}
+
+			free(fullpath);
+		}
+
+		dir += end ? len + 1 : len;
+	}
+
+	return NULL;
+}
+
+/*
+ *The lookup_command function returns the full path of 'name', from the command hash if it was resolved before and
+ *by searching 'search' otherwise. Commands that are found are remembered; commands that are not are searched for
+ *again next time, since they may have been installed in the meantime.
+ *
+ *Return:
+ *- The full path, owned by the hash, or NULL if the command does not exist on the search path.
+ */
+char *lookup_command(const char *name, const char *search)
+{
+	unsigned bucket = hash_name(name);
+	hash_entry *entry;
+
+	for (entry = command_hash[bucket]; entry != NULL; entry = entry->next)
+	{
+		if (strcmp(entry->name, name) == 0)
+		{
+			return entry->fullpath;
+		}
+	}
+
+	char *fullpath = resolve_command(name, search);
+	if (fullpath == NULL)
+	{
+		return NULL;
+	}
+
+	entry = malloc(sizeof(hash_entry));
+	entry->name = strdup(name);
+	entry->fullpath = fullpath;
+	entry->next = command_hash[bucket];
+	command_hash[bucket] = entry;
+	return fullpath;
+}
+
+/*
+ *The forget_command function drops 'name' from the command hash, e.g. because its executable has disappeared.
+ */
+void forget_command(const char *name)
+{
+	hash_entry **link = &command_hash[hash_name(name)];
+
+	while (*link != NULL)
+	{
+		hash_entry *entry = *link;
+		if (strcmp(entry->name, name) == 0)
+		{
+			*link = entry->next;
+			free(entry->name);
+			free(entry->fullpath);
+			free(entry);
+			return;
+		}
+
+		link = &entry->next;
+	}
+}
+
+/*
+ *The clear_commands function empties the command hash. It is called whenever the search path changes, and on cd,
+ *since the path may hold relative directories.
+ */
+void clear_commands(void)
+{
+	int i;
+	for (i = 0; i < HASH_BUCKETS; i++)
+	{
+		while (command_hash[i] != NULL)
+		{
+			hash_entry *entry = command_hash[i];
+			command_hash[i] = entry->next;
+			free(entry->name);
+			free(entry->fullpath);
+			free(entry);
+		}
+	}
+}
+
 void print_prompt(int interactive)
 {
 	if (interactive)
@@ -159,170 +451,831 @@ void print_prompt(int interactive)
 }
 
 /*
- *The separate_command function tokenizes the input string (cmd) based on the "&" delimiter. It stores the resulting
- *tokens in the shell.commands array and returns the number of tokens found. This function is used to separate
- *commands that should be executed in parallel (concurrently) in the shell.
+ *The grow function makes room for one more element in one of the shell's growable arrays, doubling its capacity
+ *when it is full.
  *
  *Parameters:
- *- cmd: A pointer to a string containing the user's input.
+ *- array: The array, NULL before its first use.
+ *- size: The size of an element.
+ *- count: The number of elements in use.
+ *- cap: A pointer to the capacity, updated if the array is grown.
  *
  *Return:
- *- k: The number of commands separated by "&" found in the input string.
+ *- The array, which may have moved.
  */
-int separate_command(char cmd[])
+void *grow(void *array, size_t size, int count, int *cap)
 {
-	char *command = strtok(cmd, "&");	// Tokenize the input string using the "&" delimiter
-	int k = 0;	// Initialize the counter 
+	if (count < *cap)
+	{
+		return array;
+	}
 
-	// Loop throigh the tokens and store them in the shell.commands
-	while (command != NULL)
+	*cap = *cap ? *cap * 2 : 16;
+	array = realloc(array, size * *cap);
+	if (array == NULL)
 	{
-		shell.commands[k] = command;
-		command = strtok(NULL, "&");	// Get the next command, if it exists
-		k++;
+		fprintf(stderr, "%s\n", error_message);
+		exit(1);
 	}
 
-	return k;
+	return array;
+}
+
+void start_stage(void)
+{
+	stage_info *stage;
+
+	shell.stages = grow(shell.stages, sizeof(stage_info), shell.numStages, &shell.stagesCap);
+	stage = &shell.stages[shell.numStages++];
+	stage->first = shell.numWords;
+	stage->argc = 0;
+	stage->redirects = 0;
+	stage->filename = NULL;
+	stage->badRedirect = 0;
+	shell.commands[shell.numCommands - 1].count++;
+}
+
+void start_command(void)
+{
+	shell.commands = grow(shell.commands, sizeof(command_info), shell.numCommands, &shell.commandsCap);
+	shell.commands[shell.numCommands].first = shell.numStages;
+	shell.commands[shell.numCommands].count = 0;
+	shell.numCommands++;
+	start_stage();
+}
+
+void push_word(char *word)
+{
+	shell.words = grow(shell.words, sizeof(char *), shell.numWords, &shell.wordsCap);
+	shell.words[shell.numWords++] = word;
 }
 
 /*
- *The split_command function tokenizes the input command string based on whitespace characters (" \t\n"). It stores the
- *resulting tokens (arguments) in the shell.args array, which can be used later to execute the command.
- *
- *Parameters:
- *- p: The index of the command in the shell.commands array.
+ *The add_word function puts a word that was just scanned in the current stage: before a '>' it is an argument,
+ *after it the name of the file. A second word after the '>' makes the redirection malformed.
  */
-void split_command(int p)
+void add_word(char *word)
 {
-	// Tokenize the command string using whitespace characters as delimiters
-	char *arg = strtok(shell.commands[p], " \t\n");
-	int i = 0;
+	stage_info *stage = &shell.stages[shell.numStages - 1];
 
-	// Loop through the tokens (arguments) and store them in the shell.args array
-	while (arg != NULL)
+	if (stage->redirects == 0)
 	{
-		shell.args[i] = arg;
-		arg = strtok(NULL, " \t\n");
-		i++;
+		push_word(word);
+		stage->argc++;
+	}
+	else if (stage->filename == NULL)
+	{
+		stage->filename = word;
 	}
+	else
+	{
+		stage->badRedirect = 1;
+	}
+}
 
-	shell.args[i] = NULL;	// Mark the end of the arguments list with a NULL pointer
+/*
+ *The end_stage function terminates the current stage's arguments and checks its redirection: it must have
+ *exactly one '>', followed by exactly one file, and a command before it.
+ */
+void end_stage(void)
+{
+	stage_info *stage = &shell.stages[shell.numStages - 1];
+
+	push_word(NULL);
+	if (stage->redirects > 1 || (stage->redirects == 1 && (stage->filename == NULL || stage->argc == 0)))
+	{
+		stage->badRedirect = 1;
+	}
 }
 
 /*
- *The check_redirection function scans the arguments list (shell.args) for output redirection using the '>' symbol.
- *It sets shell.outputRedirect and shell.filename accordingly. If multiple output files are detected, it sets
- *shell.multipleFiles to 1.
+ *The end_command function finishes the current command. A command with nothing in it, e.g. between two '&', is
+ *dropped.
  */
-void check_redirection(void)
+void end_command(void)
 {
-	int j;
-	shell.multipleFiles = 0;
-	shell.outputRedirect = 0;
+	command_info *command = &shell.commands[shell.numCommands - 1];
+	stage_info *stage = &shell.stages[command->first];
 
-	// Loop through the arguments list
-	for (j = 0; shell.args[j] != NULL; j++)
+	end_stage();
+	if (command->count == 1 && stage->argc == 0 && stage->redirects == 0)
 	{
-		// Check if the current argument is '>' and it is not the first argument
-		if ((strcmp(shell.args[j], ">") == 0) && (strcmp(shell.args[0], ">") != 0))
+		shell.numCommands--;
+		shell.numStages--;
+		shell.numWords--;
+	}
+}
+
+/*
+ *The parse_line function splits a line into commands ('&'), their stages ('|'), the arguments of each stage
+ *(whitespace) and its redirection ('>'), all in one scan. Single quotes keep everything up to the next single quote
+ *as it is; inside double quotes, and outside quotes, a backslash keeps the character after it. Quoted '&', '|' and
+ *'>' are ordinary characters.
+ *
+ *The words are unquoted in place: each one is copied towards the start of the line over characters that have been
+ *read already, and terminated with a null character. The results go to shell.commands, shell.stages and
+ *shell.words.
+ *
+ *Parameters:
+ *- line: The line, including its newline, if any. It is modified.
+ *
+ *Return:
+ *- 0 on success, -1 if a quote is not closed or the line ends in a backslash.
+ */
+int parse_line(char *line)
+{
+	char *r = line;	// next character to read
+	char *w = line;	// where the next character of a word goes
+	char *word = NULL;	// start of the word being scanned, if any
+
+	shell.numCommands = 0;
+	shell.numStages = 0;
+	shell.numWords = 0;
+	start_command();
+
+	while (1)
+	{
+		char c = *r;
+
+		if (c == '\0' || c == ' ' || c == '\t' || c == '\n' || c == '&' || c == '|' || c == '>')
 		{
-			// Check if there are more than one output files 
-			if (shell.args[j + 2] != NULL)
+			if (word != NULL)
 			{
-				shell.multipleFiles = 1;
+				*w++ = '\0';
+				add_word(word);
+				word = NULL;
 			}
-			else
+
+			if (c == '\0')
 			{
-			 	// Set the outputRedirect flag and save the filename
-				shell.outputRedirect = 1;
-				shell.filename = shell.args[j + 1];
-				shell.args[j] = NULL;	// Remove the '>' symbol from the arguments list
+				break;
 			}
+
+			r++;
+			if (c == '&')
+			{
+				end_command();
+				start_command();
+			}
+			else if (c == '|')
+			{
+				end_stage();
+				start_stage();
+			}
+			else if (c == '>')
+			{
+				shell.stages[shell.numStages - 1].redirects++;
+			}
+
+			continue;
 		}
-		else
+
+		if (word == NULL)
 		{
-			// Check if the '>' symbol is present within the current argument
-			// For cases like ls>output.txt
-			char *pos = strchr(shell.args[j], '>');
+			word = w;
+		}
 
-			if (pos)
+		if (c == '\'' || c == '"')
+		{
+			// Up to the closing quote; in double quotes, a backslash keeps the character after it
+			for (r++; *r != c; )
 			{
-			 	// Check if there are more than one output files 
-				if (shell.args[j + 1] != NULL)
+				if (*r == '\0')
 				{
-					shell.multipleFiles = 1;
+					return -1;
 				}
-				else
-				{
-				 		// Tokenize the current argument using the `>` symbol 
-					char *arg = strtok(shell.args[j], ">");
-					shell.args[j] = arg;
 
-					shell.outputRedirect = 1;
-					arg = strtok(NULL, ">");
-					shell.filename = arg;
+				if (c == '"' && *r == '\\' && r[1] != '\0')
+				{
+					r++;
 				}
+
+				*w++ = *r++;
+			}
+
+			r++;
+		}
+		else if (c == '\\')
+		{
+			if (r[1] == '\0' || r[1] == '\n')
+			{
+				return -1;
 			}
+
+			r++;
+			*w++ = *r++;
+		}
+		else
+		{
+			*w++ = *r++;
 		}
 	}
+
+	end_command();
+	return 0;
+}
+
+/*
+ *The select_stage function makes a parsed stage the one to run: it points shell.args at its arguments, sets
+ *shell.outputRedirect, shell.filename and shell.multipleFiles from its redirection, and makes shell.actions open
+ *the file as standard output.
+ *
+ *Parameters:
+ *- stage: The index of the stage in shell.stages.
+ */
+void select_stage(int stage)
+{
+	stage_info *info = &shell.stages[stage];
+
+	shell.args = &shell.words[info->first];
+	shell.outputRedirect = info->redirects > 0;
+	shell.filename = info->filename;
+	shell.multipleFiles = info->badRedirect;
+
+	posix_spawn_file_actions_destroy(&shell.actions);
+	posix_spawn_file_actions_init(&shell.actions);
+	if (shell.outputRedirect && !shell.multipleFiles)
+	{
+		posix_spawn_file_actions_addopen(&shell.actions, STDOUT_FILENO, shell.filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	}
+}
+
+/*
+ *The spawn_command function starts shell.args as a child process with posix_spawn, which, unlike fork, does not
+ *copy the shell's page tables. The executable comes from the command hash; if a remembered one has gone away, the
+ *command is looked up on 'search' again and retried once.
+ *
+ *Return:
+ *- 0 if the command was started, otherwise an error number.
+ */
+int spawn_command(const char *search)
+{
+	int retry;
+	int err = ENOENT;
+
+	for (retry = 0; retry < 2 && err == ENOENT; retry++)
+	{
+		pid_t pid;
+		double start = now();
+		char *fullpath = lookup_command(shell.args[0], search);
+		if (fullpath == NULL)
+		{
+			return ENOENT;
+		}
+
+		err = posix_spawn(&pid, fullpath, &shell.actions, NULL, shell.args, environ);
+		if (err == 0)
+		{
+			add_job(pid, start);
+		}
+
+		if (err == ENOENT && access(fullpath, X_OK) != 0)
+		{
+			forget_command(shell.args[0]);
+		}
+		else
+		{
+			return err;	// started, or failed for another reason such as the redirection's directory
+		}
+	}
+
+	return err;
+}
+
+/*
+ *The execute_pipesize function sets the buffer size of the pipes that later pipelines are connected with, e.g.
+ *"pipesize 1048576". Larger pipes let a fast producer run further ahead of its consumer before it has to block.
+ *"pipesize 0" goes back to the system default.
+ *Parameters:
+ *- arg: A NULL-terminated array of pointers to strings, where arg[0] is "pipesize" and arg[1] the size in bytes.
+ */
+void execute_pipesize(char **arg)
+{
+	char *end;
+	long size;
+
+	if (arg[1] == NULL || arg[2] != NULL)
+	{
+		fprintf(stderr, "%s\n", error_message);
+		return;
+	}
+
+	size = strtol(arg[1], &end, 10);
+	if (*end != '\0' || end == arg[1] || size < 0 || size > (1 << 30))
+	{
+		fprintf(stderr, "%s\n", error_message);
+		return;
+	}
+
+	shell.pipeSize = size;
+}
+
+/*
+ *The is_builtin function tells whether 'name' is one of the shell's built-in commands.
+ */
+int is_builtin(const char *name)
+{
+	return strcmp(name, "exit") == 0 || strcmp(name, "cd") == 0 || strcmp(name, "path") == 0 ||
+		strcmp(name, "pipesize") == 0;
+}
+
+/*
+ *The now function returns the time in seconds on the monotonic clock.
+ */
+double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ *The join_args function returns the arguments in shell.args joined by spaces, in a newly allocated string.
+ */
+char *join_args(void)
+{
+	size_t len = 0;
+	char *text;
+	int i;
+
+	for (i = 0; shell.args[i] != NULL; i++)
+	{
+		len += strlen(shell.args[i]) + 1;
+	}
+
+	text = malloc(len + 1);
+	text[0] = '\0';
+	for (len = 0, i = 0; shell.args[i] != NULL; i++)
+	{
+		len += sprintf(text + len, i ? " %s" : "%s", shell.args[i]);
+	}
+
+	return text;
+}
+
+/*
+ *The add_job function records a child process that was just started from shell.args.
+ *
+ *Parameters:
+ *- pid: Its process id.
+ *- start: When it was started, from now().
+ */
+void add_job(pid_t pid, double start)
+{
+	job_info *job;
+
+	shell.jobs = grow(shell.jobs, sizeof(job_info), shell.running, &shell.jobsCap);
+	job = &shell.jobs[shell.running++];
+	job->pid = pid;
+	job->start = start;
+	job->line = shell.lineNumber;
+	job->timed = shell.timing;
+	job->command = shell.report != NULL ? join_args() : NULL;
+	if (shell.timing)
+	{
+		shell.timedRunning++;
+		shell.timedLast = pid;
+	}
+
+	if (shell.running > shell.peakRunning)
+	{
+		shell.peakRunning = shell.running;
+	}
+}
+
+/*
+ *The account_job function adds a finished job to the totals of the report, to the result of the 'time' built-in
+ *if the job belongs to it, and to the list of slowest jobs if it is one of them. The list is kept sorted, slowest
+ *first; the job's command is freed if it does not make it.
+ */
+void account_job(job_info *job)
+{
+	job_usage *usage = &job->usage;
+	int i;
+
+	shell.finished++;
+	shell.failed += usage->status != 0;
+	shell.total.real += usage->real;
+	shell.total.user += usage->user;
+	shell.total.sys += usage->sys;
+
+	if (job->timed)
+	{
+		shell.timedRunning--;
+		shell.timedUsage.user += usage->user;
+		shell.timedUsage.sys += usage->sys;
+		if (usage->maxrss > shell.timedUsage.maxrss)
+		{
+			shell.timedUsage.maxrss = usage->maxrss;
+		}
+
+		if (job->pid == shell.timedLast)
+		{
+			shell.timedUsage.status = usage->status;	// a pipeline's is that of its last stage
+		}
+	}
+
+	if (job->command == NULL)
+	{
+		return;
+	}
+
+	if (shell.numSlowest == REPORT_SLOWEST)
+	{
+		if (shell.slowest[REPORT_SLOWEST - 1].usage.real >= usage->real)
+		{
+			free(job->command);
+			return;
+		}
+
+		free(shell.slowest[--shell.numSlowest].command);
+	}
+
+	for (i = shell.numSlowest; i > 0 && shell.slowest[i - 1].usage.real < usage->real; i--)
+	{
+		shell.slowest[i] = shell.slowest[i - 1];
+	}
+
+	shell.slowest[i] = *job;
+	shell.numSlowest++;
+}
+
+/*
+ *The reap_job function waits for any one child process to end, with wait4, which also returns the resources it
+ *used, and accounts for it.
+ *
+ *Return:
+ *- 1 if a child was reaped, 0 if there are none left.
+ */
+int reap_job(void)
+{
+	struct rusage ru;
+	int status;
+	pid_t pid;
+	int i;
+
+	while ((pid = wait4(-1, &status, 0, &ru)) == -1)
+	{
+		if (errno != EINTR)
+		{
+			shell.running = 0;
+			shell.timedRunning = 0;
+			return 0;
+		}
+	}
+
+	for (i = 0; i < shell.running; i++)
+	{
+		if (shell.jobs[i].pid == pid)
+		{
+			job_info job = shell.jobs[i];
+
+			shell.jobs[i] = shell.jobs[--shell.running];
+			job.usage.real = now() - job.start;
+			job.usage.user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+			job.usage.sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+			job.usage.maxrss = ru.ru_maxrss;
+			job.usage.status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+			account_job(&job);
+			break;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ *The start_timing function is called when a command starts with the 'time' built-in: the processes started until
+ *finish_timing() make up the timed command.
+ */
+void start_timing(void)
+{
+	memset(&shell.timedUsage, 0, sizeof(job_usage));
+	shell.timedUsage.real = now();
+	shell.timedLast = 0;
+	shell.timing = 1;
+}
+
+/*
+ *The finish_timing function waits for the processes of the timed command, reaping any other job that ends in the
+ *meantime, and prints what they used to stderr. CPU times are summed over the stages of a pipeline, and the peak
+ *resident set size is that of the largest. Nothing is printed if no process could be started: the error has been
+ *reported already.
+ */
+void finish_timing(void)
+{
+	shell.timing = 0;
+	if (shell.timedLast == 0)
+	{
+		return;
+	}
+
+	while (shell.timedRunning > 0 && reap_job());
+
+	fprintf(stderr, "real %.3fs user %.3fs sys %.3fs maxrss %ldkB status %d\n", now() - shell.timedUsage.real,
+		shell.timedUsage.user, shell.timedUsage.sys, shell.timedUsage.maxrss, shell.timedUsage.status);
+}
+
+/*
+ *The print_json_string function writes 's' to 'out' as a JSON string.
+ */
+void print_json_string(FILE *out, const char *s)
+{
+	fputc('"', out);
+	for (; *s; s++)
+	{
+		if (*s == '"' || *s == '\\')
+		{
+			fprintf(out, "\\%c", *s);
+		}
+		else if ((unsigned char) *s < 0x20)
+		{
+			fprintf(out, "\\u%04x", *s);
+		}
+		else
+		{
+			fputc(*s, out);
+		}
+	}
+
+	fputc('"', out);
+}
+
+/*
+ *The write_report function writes the summary asked for with -r to shell.report, as JSON: the totals over all jobs,
+ *how well they used the time the script ran, and the slowest jobs with what they used.
+ *
+ *"parallelism" is the sum of the jobs' wall-clock times divided by the time the script ran, i.e. the average
+ *number of jobs running. "efficiency" divides it by the slots the jobs had: N with -j N, otherwise the most jobs
+ *that ever ran at once.
+ */
+void write_report(char *script)
+{
+	double elapsed = now() - shell.startTime;
+	int slots = shell.maxJobs > 0 ? shell.maxJobs : shell.peakRunning;
+	double parallelism = elapsed > 0 ? shell.total.real / elapsed : 0;
+	FILE *out = fopen(shell.report, "w");
+	int i;
+
+	if (out == NULL)
+	{
+		fprintf(stderr, "%s\n", error_message);
+		return;
+	}
+
+	fprintf(out, "{\n  \"script\": ");
+	print_json_string(out, script != NULL ? script : "-");
+	fprintf(out, ",\n  \"elapsed_seconds\": %.6f,\n", elapsed);
+	fprintf(out, "  \"jobs\": %d,\n  \"failed\": %d,\n", shell.finished, shell.failed);
+	fprintf(out, "  \"job_seconds\": %.6f,\n", shell.total.real);
+	fprintf(out, "  \"user_seconds\": %.6f,\n  \"sys_seconds\": %.6f,\n", shell.total.user, shell.total.sys);
+	fprintf(out, "  \"slots\": %d,\n  \"peak_jobs\": %d,\n", slots, shell.peakRunning);
+	fprintf(out, "  \"parallelism\": %.3f,\n", parallelism);
+	fprintf(out, "  \"efficiency\": %.3f,\n", slots > 0 ? parallelism / slots : 0);
+	fprintf(out, "  \"slowest\": [");
+	for (i = 0; i < shell.numSlowest; i++)
+	{
+		job_info *job = &shell.slowest[i];
+
+		fprintf(out, "%s\n    {\"line\": %d, \"command\": ", i ? "," : "", job->line);
+		print_json_string(out, job->command);
+		fprintf(out, ", \"real_seconds\": %.6f, \"user_seconds\": %.6f, \"sys_seconds\": %.6f, "
+			"\"max_rss_kb\": %ld, \"status\": %d}", job->usage.real, job->usage.user, job->usage.sys,
+			job->usage.maxrss, job->usage.status);
+		free(job->command);
+	}
+
+	fprintf(out, "%s]\n}\n", shell.numSlowest ? "\n  " : "");
+	fclose(out);
+}
+
+/*
+ *The wait_for_slots function is the scheduler of -j mode: before 'needed' more child processes are started, it
+ *reaps children until they fit within shell.maxJobs. A pipeline longer than the limit waits until nothing else
+ *is running. Without -j, it does nothing; lines are then waited for as a whole.
+ */
+void wait_for_slots(int needed)
+{
+	if (shell.maxJobs == 0)
+	{
+		return;
+	}
+
+	while (shell.running > 0 && shell.running + needed > shell.maxJobs)
+	{
+		reap_job();
+	}
+}
+
+/*
+ *The drain_jobs function waits for every child process still running, and accounts for each.
+ */
+void drain_jobs(void)
+{
+	while (shell.running > 0 && reap_job());
+}
+
+/*
+ *The run_pipeline function starts the stages of a command, each one's standard output connected to the next
+ *one's standard input by a pipe. Data flows from child to child; the shell only sets the pipes up. Only the last
+ *stage may redirect its output, and built-in commands cannot be part of a pipeline. The stages run in parallel
+ *and are waited for like any other command.
+ *
+ *Parameters:
+ *- command: The index of the command in shell.commands; it has at least 2 stages.
+ *- search: The search path.
+ *- timed: Flag indicating if the command is run by the 'time' built-in (1) or not (0); timing starts once the
+ *  stages have job slots, so that waiting for other jobs is not counted.
+ */
+void run_pipeline(int command, const char *search, int timed)
+{
+	int first = shell.commands[command].first;
+	int num_stages = shell.commands[command].count;
+	int in_fd = -1;	// read end of the pipe from the previous stage
+	int i;
+
+	wait_for_slots(num_stages);
+	if (timed)
+	{
+		start_timing();
+	}
+
+	for (i = 0; i < num_stages; i++)
+	{
+		int last = i == num_stages - 1;
+		int fds[2];
+
+		select_stage(first + i);
+		if (shell.args[0] == NULL || is_builtin(shell.args[0]) || shell.notAllowed)
+		{
+			fprintf(stderr, "%s\n", error_message);
+			break;
+		}
+
+		if (shell.multipleFiles || (shell.outputRedirect && !last))
+		{
+			fprintf(stderr, "%s\n", error_message);
+			break;
+		}
+
+		// The pipe's own descriptors are closed on exec; each child only keeps its copies as stdin and stdout
+		if (!last)
+		{
+			if (pipe2(fds, O_CLOEXEC) == -1)
+			{
+				fprintf(stderr, "%s\n", error_message);
+				break;
+			}
+
+			if (shell.pipeSize > 0)
+			{
+				fcntl(fds[1], F_SETPIPE_SZ, shell.pipeSize);	// best effort: the default size still works
+			}
+
+			posix_spawn_file_actions_adddup2(&shell.actions, fds[1], STDOUT_FILENO);
+		}
+
+		if (in_fd != -1)
+		{
+			posix_spawn_file_actions_adddup2(&shell.actions, in_fd, STDIN_FILENO);
+		}
+
+		if (spawn_command(search) != 0)
+		{
+			fprintf(stderr, "%s\n", error_message);
+		}
+
+		if (in_fd != -1)
+		{
+			close(in_fd);
+			in_fd = -1;
+		}
+
+		if (!last)
+		{
+			close(fds[1]);
+			in_fd = fds[0];
+		}
+	}
+
+	if (in_fd != -1)
+	{
+		close(in_fd);
+	}
+
+	// Leave no dup2 actions behind for the next command
+	posix_spawn_file_actions_destroy(&shell.actions);
+	posix_spawn_file_actions_init(&shell.actions);
 }
 
 int main(int argc, char *argv[])
 {
-	char command[MAX_COMMAND_LENGTH];
+	char *line = NULL;	// the current line, grown by getline as needed
+	size_t lineCap = 0;
 	char *path = getenv("PATH");	// retrieve value of the environment variable "PATH"
 	char *pathCopy = strdup(path);
-	int num_cmd = 0;	// number of commands separated by the '&'
 	int breakLoop = 0;
+	int opt;
 
 	initialize_shell();
 
-	if (argc > 2)
+	// wish [-n] [-j N] [-r report] [script]
+	opterr = 0;
+	while ((opt = getopt(argc, argv, "nj:r:")) != -1)
+	{
+		char *end;
+		long jobs;
+
+		if (opt == 'n')
+		{
+			shell.parseOnly = 1;
+			continue;
+		}
+		else if (opt == 'r')
+		{
+			shell.report = optarg;
+			continue;
+		}
+
+		jobs = opt == 'j' ? strtol(optarg, &end, 10) : 0;
+		if (opt != 'j' || *end != '\0' || jobs <= 0 || jobs > 100000)
+		{
+			fprintf(stderr, "%s\n", error_message);
+			free(pathCopy);
+			exit(1);
+		}
+
+		shell.maxJobs = jobs;
+	}
+
+	if (argc - optind > 1)
 	{
 		fprintf(stderr, "%s\n", error_message);
 		free(pathCopy);
 		exit(1);
 	}
 
-	check_bash_mode(argc, argv);
+	check_bash_mode(optind < argc ? argv[optind] : NULL);
 
 	while (1)
 	{
 		// Get the user input 
 		print_prompt(shell.interactive);
 
-		// Read user input into the cmd array
-		if (fgets(command, MAX_COMMAND_LENGTH, shell.stream) == NULL)
+		// Read user input, however long the line is
+		if (getline(&line, &lineCap, shell.stream) == -1)
 		{
-			free(pathCopy);
-			exit(0);
+			break;
 		}
 
-		//  Remove the newline character from the end of the input by replacing it with a null character
-		command[strcspn(command, "\n")] = '\0';
-		if (strlen(command) == 0)
+		shell.lineNumber++;
+
+		// Split the line into commands separated by '&', their pipeline stages and their arguments
+		if (parse_line(line) != 0)
 		{
+			fprintf(stderr, "%s\n", error_message);
 			continue;
 		}
 
-		// call the separate_cmd function, which separates multiple
-		// commands in the input string (if commands are separated by '&' symbol)
-		num_cmd = separate_command(command);
+		if (shell.parseOnly)
+		{
+			continue;
+		}
 
 		shell.current_command = 0;	// index of the current command being processed
-		while (shell.current_command < num_cmd)
+		while (shell.current_command < shell.numCommands)
 		{
-			// Split input into array of arguments 
+			command_info *cmd = &shell.commands[shell.current_command];
+			stage_info *first = &shell.stages[cmd->first];
+
+			// 'time' runs the rest of the command, waits for it and prints what it used
+			int timed = first->argc > 0 && strcmp(shell.words[first->first], "time") == 0;
+			if (timed)
+			{
+				first->first++;
+				first->argc--;
+				if (first->argc == 0 || (cmd->count == 1 && is_builtin(shell.words[first->first])))
+				{
+					fprintf(stderr, "%s\n", error_message);
+					shell.current_command++;
+					continue;
+				}
+			}
 
-			split_command(shell.current_command);
-			if (shell.args[0] == NULL)
+			// A pipeline is run as a whole
+			if (cmd->count > 1)
 			{
+				run_pipeline(shell.current_command, pathCopy, timed);
+				if (timed)
+				{
+					finish_timing();
+				}
+
 				shell.current_command++;
 				continue;
 			}
 
-			check_redirection();
-
+			select_stage(cmd->first);
 			if (shell.multipleFiles)
 			{
 				fprintf(stderr, "%s\n", error_message);
@@ -330,6 +1283,12 @@ int main(int argc, char *argv[])
 				continue;
 			}
 
+			// With -j, lines before a built-in are finished first: it may change how later ones run
+			if (shell.maxJobs > 0 && is_builtin(shell.args[0]))
+			{
+				drain_jobs();
+			}
+
 			if (strcmp(shell.args[0], "exit") == 0)
 			{
 				if (shell.args[1] != NULL)
@@ -345,6 +1304,7 @@ int main(int argc, char *argv[])
 			else if (strcmp(shell.args[0], "cd") == 0)
 			{
 				execute_cd(shell.args);
+				clear_commands();
 			}
 			else if (strcmp(shell.args[0], "path") == 0)
 			{
@@ -354,79 +1314,33 @@ int main(int argc, char *argv[])
 				}
 				else
 				{
+					free(pathCopy);
 					pathCopy = execute_path(shell.args, path);
 				}
+
+				clear_commands();
+			}
+			else if (strcmp(shell.args[0], "pipesize") == 0)
+			{
+				execute_pipesize(shell.args);
 			}
 			else if (!shell.notAllowed)
 			{
-			 	// Fork a child process to execute the command
-				pid_t pid = fork();
-
-				if (pid == 0)
+			 	// Launch the command; the shell is not copied, and the redirection is applied by file actions
+				wait_for_slots(1);
+				if (timed)
 				{
-				 		// Child process: execute the command
-					char *fullpath;
-					char *token;
-					int i = 0;
-					int found = 0;
-					while (!found && (token = strtok(pathCopy, ":")) != NULL)
-					{
-						i++;
-						pathCopy = NULL;
-						fullpath = malloc(strlen(token) + strlen(shell.args[0]) + 2);
-						sprintf(fullpath, "%s/%s", token, shell.args[0]);
-						if (access(fullpath, X_OK) == 0)
-						{
-
-							if (shell.outputRedirect)
-							{
-								int output_fd = open(shell.filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-								if (output_fd == -1)
-								{
-									fprintf(stderr, "%s\n", error_message);
-									free(pathCopy);
-									exit(EXIT_FAILURE);
-								}
-
-								if (dup2(output_fd, STDOUT_FILENO) == -1)
-								{
-									fprintf(stderr, "%s\n", error_message);
-									free(pathCopy);
-									exit(EXIT_FAILURE);
-								}
-							}
-
-							execv(fullpath, shell.args);
-							perror(shell.args[0]);
-							free(fullpath);
-							//close(output_fd);
-							free(pathCopy);
-							exit(EXIT_FAILURE);
-						}
-
-						free(fullpath);
-					}
-
-					if (i == 0)
-					{
-						fprintf(stderr, "%s\n", error_message);
-					}
-					else
-					{
-						fprintf(stderr, "%s\n", error_message);
-					}
-
-					free(pathCopy);
-					exit(EXIT_FAILURE);
+					start_timing();
 				}
-				else if (pid < 0)
+
+				if (spawn_command(pathCopy) != 0)
 				{
-				 		// Fork error
 					fprintf(stderr, "%s\n", error_message);
 				}
-				else
+
+				if (timed)
 				{
-				 		// Parent process:
+					finish_timing();
 				}
 			}
 			else
@@ -442,9 +1356,25 @@ int main(int argc, char *argv[])
 			break;
 		}
 
-		while (wait(NULL) > 0);
+		// Without -j, the whole line is waited for before the next one is read
+		if (shell.maxJobs == 0)
+		{
+			drain_jobs();
+		}
+	}
+
+	drain_jobs();
+	if (shell.report != NULL)
+	{
+		write_report(optind < argc ? argv[optind] : NULL);
 	}
 
+	clear_commands();
+	free(shell.commands);
+	free(shell.stages);
+	free(shell.words);
+	free(shell.jobs);
+	free(line);
 	free(pathCopy);
 	return 0;
 }
\ No newline at end of file